@@ -0,0 +1,150 @@
+#include "./type.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <spdlog/spdlog.h>
+
+// A line longer than this is not a command; drop the client
+static const size_t ADMIN_MAX_LINE = 4096;
+
+Admin_socket::Admin_socket(Proxy_server *server, const std::string &path)
+    : path_(path),
+      listen_fd(-1)
+{
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path))
+    {
+        spdlog::error("admin_socket path too long: {}", path);
+        exit(EXIT_FAILURE);
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path.c_str());
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0)
+    {
+        spdlog::error("admin socket creation problem...");
+        exit(EXIT_FAILURE);
+    }
+
+    // left behind by a previous process that did not exit cleanly
+    unlink(path.c_str());
+
+    // owner only: the socket can drain and retune the proxy
+    mode_t old_mask = umask(0077);
+    int ret = bind(listen_fd, (sockaddr *)&addr, sizeof(addr));
+    umask(old_mask);
+    if (ret < 0 || listen(listen_fd, 16) < 0)
+    {
+        spdlog::error("admin socket bind problem... ({})", path);
+        exit(EXIT_FAILURE);
+    }
+
+    if (server->add_epoll_event(listen_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    {
+        spdlog::error("add admin socket event failed");
+        exit(EXIT_FAILURE);
+    }
+    spdlog::info("admin socket on {}", path);
+}
+
+Admin_socket::~Admin_socket()
+{
+    for (auto &[fd, _] : clients_)
+        close(fd);
+    close(listen_fd);
+    unlink(path_.c_str());
+}
+
+void Admin_socket::close_client(Proxy_server *server, int fd)
+{
+    epoll_ctl(server->ep_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    clients_.erase(fd);
+}
+
+/**
+ * Accept, read commands and flush replies. Level triggered: a reply that
+ * does not fit the socket buffer waits for EPOLLOUT.
+ */
+void Admin_socket::handle(Proxy_server *server, int fd, uint32_t events)
+{
+    if (fd == listen_fd)
+    {
+        while (true)
+        {
+            int client_fd = accept4(listen_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_fd < 0)
+                return;
+            if (server->add_epoll_event(client_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+            {
+                close(client_fd);
+                continue;
+            }
+            clients_[client_fd] = Client{"", "", false};
+        }
+    }
+
+    Client &client = clients_[fd];
+
+    if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !client.closing)
+    {
+        char buffer[1024];
+        while (true)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n > 0)
+            {
+                client.in.append(buffer, n);
+                continue;
+            }
+            if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+                client.closing = true;
+            break;
+        }
+
+        size_t eol;
+        while ((eol = client.in.find('\n')) != std::string::npos)
+        {
+            std::string line = client.in.substr(0, eol);
+            client.in.erase(0, eol + 1);
+            if (!line.empty() && line.back() == '\r')
+                line.pop_back();
+            if (!line.empty())
+                client.out += admin_command(server, line) + "\n";
+        }
+        if (client.in.size() > ADMIN_MAX_LINE)
+        {
+            close_client(server, fd);
+            return;
+        }
+    }
+
+    while (!client.out.empty())
+    {
+        ssize_t n = send(fd, client.out.data(), client.out.size(), MSG_NOSIGNAL);
+        if (n < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            close_client(server, fd);
+            return;
+        }
+        client.out.erase(0, n);
+    }
+
+    if (client.out.empty() && client.closing)
+    {
+        close_client(server, fd);
+        return;
+    }
+    uint32_t want = EPOLLIN;
+    if (!client.out.empty())
+        want = client.closing ? EPOLLOUT : EPOLLIN | EPOLLOUT;
+    server->add_epoll_event(fd, EPOLL_CTL_MOD, want);
+}
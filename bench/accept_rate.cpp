@@ -0,0 +1,167 @@
+/**
+ * accept_rate: accepts per second through the proxy, each connection from
+ * its own source address, so the per-IP rate limiter sees as many
+ * distinct keys as connections (ip_table_size is far smaller).
+ *
+ *   accept_rate [-n connections] [-c concurrency] [-b backend-port] proxy-port
+ *
+ * Sources are 127.1.0.0 onwards, all local on Linux, so one host is
+ * enough for 1M of them. The tool is also the backend: it listens on
+ * backend-port (default proxy-port + 1) and resets every upstream
+ * connection it accepts; the proxy then closes the client, which ends
+ * that connection here. A client closed without an upstream behind it
+ * was shed by the proxy. Every socket closes with RST, so no TIME_WAIT
+ * piles up. A plain route for it:
+ *
+ *   {"server_listen": 9000, "proxy_pass": 9001, "ip_rate": 10, "ip_burst": 20}
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <unordered_set>
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void close_with_reset(int fd)
+{
+    linger reset{1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(fd);
+}
+
+static sockaddr_in loopback(uint32_t address, int port)
+{
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(address);
+    sa.sin_port = htons(port);
+    return sa;
+}
+
+/**
+ * Non-blocking connect from 127.1.0.0 + index.
+ * return the socket, -1 failed
+ */
+static int open_client(int ep_fd, uint32_t index, int proxy_port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    sockaddr_in source = loopback(0x7F010000u + index, 0);
+    sockaddr_in proxy = loopback(0x7F000001u, proxy_port);
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLRDHUP;
+    ev.data.fd = fd;
+    if (bind(fd, (sockaddr *)&source, sizeof(source)) < 0 ||
+        (connect(fd, (sockaddr *)&proxy, sizeof(proxy)) < 0 && errno != EINPROGRESS) ||
+        epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int main(int argc, char *argv[])
+{
+    long total = 1000000;
+    long concurrency = 256;
+    int backend_port = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:c:b:")) != -1)
+    {
+        if (opt == 'n')
+            total = atol(optarg);
+        else if (opt == 'c')
+            concurrency = atol(optarg);
+        else if (opt == 'b')
+            backend_port = atoi(optarg);
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 1 || total <= 0 || total > (1l << 24) - 0x10000 || concurrency <= 0)
+    {
+        fprintf(stderr, "usage: %s [-n connections] [-c concurrency] [-b backend-port] proxy-port\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int proxy_port = atoi(argv[optind]);
+    if (backend_port == 0)
+        backend_port = proxy_port + 1;
+
+    int ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in backend = loopback(0x7F000001u, backend_port);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd;
+    if (bind(listen_fd, (sockaddr *)&backend, sizeof(backend)) < 0 || listen(listen_fd, 4096) < 0 ||
+        epoll_ctl(ep_fd, EPOLL_CTL_ADD, listen_fd, &ev) < 0)
+    {
+        fprintf(stderr, "backend 127.0.0.1:%d: %s\n", backend_port, strerror(errno));
+        return EXIT_FAILURE;
+    }
+
+    std::unordered_set<int> clients;
+    long opened = 0, done = 0, upstreams = 0, failed = 0;
+    uint64_t start = now_ns(), last_report = start;
+    epoll_event events[512];
+    while (done + failed < total)
+    {
+        while ((long)clients.size() < concurrency && opened < total)
+        {
+            int fd = open_client(ep_fd, opened++, proxy_port);
+            if (fd < 0)
+                failed++;
+            else
+                clients.insert(fd);
+        }
+
+        int n = epoll_wait(ep_fd, events, 512, 1000);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd)
+            {
+                int upstream;
+                while ((upstream = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC)) >= 0)
+                {
+                    upstreams++;
+                    close_with_reset(upstream);
+                }
+                continue;
+            }
+            // readable, hung up or reset: the proxy let go of this client
+            clients.erase(fd);
+            close_with_reset(fd);
+            done++;
+        }
+
+        uint64_t now = now_ns();
+        if (now - last_report >= 1000000000ull)
+        {
+            fprintf(stderr, "%ld done, %.0f/s\n", done, done / ((now - start) / 1e9));
+            last_report = now;
+        }
+    }
+
+    double seconds = (now_ns() - start) / 1e9;
+    printf("%ld connections from %ld sources in %.2f s: %.0f accepts/s, %ld upstream, %ld shed, %ld failed\n",
+           done, total, seconds, done / seconds, upstreams, done > upstreams ? done - upstreams : 0, failed);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,319 @@
+/**
+ * idle_tunnels: open many idle TLS tunnels through the proxy and report
+ * its RSS per tunnel.
+ *
+ *   idle_tunnels [-n tunnels] [-r routes] [-c window] [-b backend-port] [-p] proxy-port proxy-pid
+ *
+ * Each tunnel is a TLS client (plaintext with -p) from its own source
+ * address, 127.1.0.0 onwards, that sends one byte and waits for the echo;
+ * then it stays open and idle. The tool is also the echo backend. RSS of
+ * proxy-pid (VmRSS) is read before the first tunnel and a second after
+ * the last one is up; the difference over n is the cost of a tunnel.
+ *
+ * The proxy reaches one backend port from one address, so its upstream
+ * side runs out of ephemeral ports around 28k tunnels (ip_local_port_range).
+ * -r spreads the tunnels round-robin over routes proxy-port + i ->
+ * backend-port + i (backend-port defaults to proxy-port + 1000), e.g.
+ * for -n 100000 -r 4:
+ *
+ *   {"routes": [{"server_listen": 9000, "proxy_pass": 10000, "mode": "tls"},
+ *               {"server_listen": 9001, "proxy_pass": 10001, "mode": "tls"}, ...]}
+ *
+ * Both this tool and the proxy need about 2n open files (ulimit -n).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <openssl/ssl.h>
+
+#include <string>
+#include <vector>
+
+enum Tunnel_state
+{
+    FREE,
+    BACKEND,   // echo side
+    LISTENER,  // backend listening socket
+    CONNECTING,
+    HANDSHAKE,
+    PINGED,
+    IDLE,
+};
+
+struct Tunnel
+{
+    Tunnel_state state = FREE;
+    SSL *ssl = nullptr;
+};
+
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static long rss_kb(int pid)
+{
+    std::string path = "/proc/" + std::to_string(pid) + "/status";
+    FILE *f = fopen(path.c_str(), "r");
+    if (!f)
+        return -1;
+    char line[256];
+    long kb = -1;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &kb) == 1)
+            break;
+    }
+    fclose(f);
+    return kb;
+}
+
+static sockaddr_in loopback(uint32_t address, int port)
+{
+    sockaddr_in sa{};
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(address);
+    sa.sin_port = htons(port);
+    return sa;
+}
+
+static int watch(int ep_fd, int fd, uint32_t events)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * Move a client tunnel on as far as it goes without blocking.
+ * return: 1 now idle, 0 waiting, -1 failed
+ */
+static int step(Tunnel &t, int fd, SSL_CTX *ctx)
+{
+    if (t.state == CONNECTING)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err == EINPROGRESS)
+            return 0;
+        if (err != 0)
+            return -1;
+        if (ctx)
+        {
+            t.ssl = SSL_new(ctx);
+            SSL_set_fd(t.ssl, fd);
+            t.state = HANDSHAKE;
+        }
+        else
+        {
+            if (send(fd, "x", 1, MSG_NOSIGNAL) != 1)
+                return errno == EAGAIN ? 0 : -1;
+            t.state = PINGED;
+        }
+    }
+    if (t.state == HANDSHAKE)
+    {
+        int ret = SSL_connect(t.ssl);
+        if (ret != 1)
+        {
+            int err = SSL_get_error(t.ssl, ret);
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+        }
+        if (SSL_write(t.ssl, "x", 1) != 1)
+            return -1;
+        t.state = PINGED;
+    }
+    if (t.state == PINGED)
+    {
+        char byte;
+        int n = t.ssl ? SSL_read(t.ssl, &byte, 1) : recv(fd, &byte, 1, 0);
+        if (n == 1)
+        {
+            t.state = IDLE;
+            return 1;
+        }
+        if (t.ssl)
+        {
+            int err = SSL_get_error(t.ssl, n);
+            return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+        }
+        return n < 0 && errno == EAGAIN ? 0 : -1;
+    }
+    return 0;
+}
+
+// Echo whatever arrived on a backend socket
+static void echo(int fd)
+{
+    char buffer[4096];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+    {
+        if (send(fd, buffer, n, MSG_NOSIGNAL) != n)
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    long total = 100000;
+    int routes = 1;
+    long window = 64;
+    int backend_port = 0;
+    bool plain = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:c:b:p")) != -1)
+    {
+        if (opt == 'n')
+            total = atol(optarg);
+        else if (opt == 'r')
+            routes = atoi(optarg);
+        else if (opt == 'c')
+            window = atol(optarg);
+        else if (opt == 'b')
+            backend_port = atoi(optarg);
+        else if (opt == 'p')
+            plain = true;
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 2 || total <= 0 || total > (1l << 24) - 0x10000 || routes <= 0 || window <= 0)
+    {
+        fprintf(stderr, "usage: %s [-n tunnels] [-r routes] [-c window] [-b backend-port] [-p] proxy-port proxy-pid\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int proxy_port = atoi(argv[optind]);
+    int proxy_pid = atoi(argv[optind + 1]);
+    if (backend_port == 0)
+        backend_port = proxy_port + 1000;
+
+    // a client and a backend socket per tunnel
+    rlimit files;
+    getrlimit(RLIMIT_NOFILE, &files);
+    files.rlim_cur = files.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &files);
+    if (files.rlim_cur < (rlim_t)(2 * total + 64))
+    {
+        fprintf(stderr, "open file limit %llu is too low for %ld tunnels, raise ulimit -n\n",
+                (unsigned long long)files.rlim_cur, total);
+        return EXIT_FAILURE;
+    }
+
+    SSL_CTX *ctx = nullptr;
+    if (!plain)
+    {
+        ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, nullptr);
+        // keep this side small, it holds as many SSLs as the proxy
+        SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+    }
+
+    std::vector<Tunnel> tunnels(2 * total + 64 + routes);
+    int ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    for (int i = 0; i < routes; ++i)
+    {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        sockaddr_in sa = loopback(0x7F000001u, backend_port + i);
+        if (bind(fd, (sockaddr *)&sa, sizeof(sa)) < 0 || listen(fd, 4096) < 0 || watch(ep_fd, fd, EPOLLIN) < 0)
+        {
+            fprintf(stderr, "backend 127.0.0.1:%d: %s\n", backend_port + i, strerror(errno));
+            return EXIT_FAILURE;
+        }
+        tunnels[fd].state = LISTENER;
+    }
+
+    long base_kb = rss_kb(proxy_pid);
+    if (base_kb < 0)
+    {
+        fprintf(stderr, "no process %d\n", proxy_pid);
+        return EXIT_FAILURE;
+    }
+
+    long opened = 0, idle = 0, failed = 0;
+    uint64_t start = now_ns(), last_report = start;
+    epoll_event events[512];
+    while (idle + failed < total)
+    {
+        while (opened - idle - failed < window && opened < total)
+        {
+            int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+            sockaddr_in source = loopback(0x7F010000u + opened, 0);
+            sockaddr_in proxy = loopback(0x7F000001u, proxy_port + opened % routes);
+            opened++;
+            if (fd < 0 || bind(fd, (sockaddr *)&source, sizeof(source)) < 0 ||
+                (connect(fd, (sockaddr *)&proxy, sizeof(proxy)) < 0 && errno != EINPROGRESS) ||
+                watch(ep_fd, fd, EPOLLIN | EPOLLOUT | EPOLLET) < 0)
+            {
+                if (fd >= 0)
+                    close(fd);
+                failed++;
+                continue;
+            }
+            tunnels[fd].state = CONNECTING;
+        }
+
+        int n = epoll_wait(ep_fd, events, 512, 1000);
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            Tunnel &t = tunnels[fd];
+            if (t.state == LISTENER)
+            {
+                int upstream;
+                while ((upstream = accept4(fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+                {
+                    tunnels[upstream].state = BACKEND;
+                    watch(ep_fd, upstream, EPOLLIN | EPOLLET);
+                    echo(upstream);
+                }
+            }
+            else if (t.state == BACKEND)
+            {
+                echo(fd);
+            }
+            else if (t.state != IDLE && t.state != FREE)
+            {
+                int ret = step(t, fd, ctx);
+                if (ret > 0)
+                    idle++;
+                if (ret < 0)
+                {
+                    failed++;
+                    SSL_free(t.ssl);
+                    t = Tunnel{};
+                    close(fd);
+                }
+            }
+        }
+
+        uint64_t now = now_ns();
+        if (now - last_report >= 1000000000ull)
+        {
+            fprintf(stderr, "%ld tunnels up, %ld failed\n", idle, failed);
+            last_report = now;
+        }
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    // let the proxy settle: buffers released, freed pages returned
+    sleep(1);
+    long rss = rss_kb(proxy_pid);
+    printf("%ld %s tunnels up in %.2f s, %ld failed: rss %ld kB -> %ld kB, %.1f kB per tunnel\n",
+           idle, plain ? "plaintext" : "TLS", seconds, failed, base_kb, rss, idle ? (double)(rss - base_kb) / idle : 0.0);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+#include "./type.hpp"
+
+#include <stdlib.h>
+
+#include <spdlog/spdlog.h>
+
+Buffer_pool::Buffer_pool()
+    : block_size_(0),
+      allocated_(0)
+{
+}
+
+Buffer_pool::~Buffer_pool()
+{
+    for (char *block : free_)
+        free(block);
+}
+
+/**
+ * Blocks of block_size from now on. Free blocks of another size go at
+ * once, the ones still handed out when they come back.
+ */
+void Buffer_pool::configure(size_t block_size)
+{
+    if (block_size == block_size_)
+        return;
+    for (char *block : free_)
+    {
+        blocks_.erase(block);
+        free(block);
+        allocated_--;
+    }
+    free_.clear();
+    retired_.insert(blocks_.begin(), blocks_.end());
+    blocks_.clear();
+    block_size_ = block_size;
+}
+
+char *Buffer_pool::get()
+{
+    if (!free_.empty())
+    {
+        char *block = free_.back();
+        free_.pop_back();
+        return block;
+    }
+
+    // page aligned, the kernel pins whole pages for zerocopy sends
+    void *block = nullptr;
+    if (posix_memalign(&block, 4096, block_size_) != 0)
+    {
+        spdlog::error("buffer pool allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    allocated_++;
+    blocks_.insert(static_cast<char *>(block));
+    return static_cast<char *>(block);
+}
+
+void Buffer_pool::put(char *block)
+{
+    if (!retired_.empty() && retired_.erase(block))
+    {
+        free(block);
+        allocated_--;
+        return;
+    }
+    free_.push_back(block);
+}
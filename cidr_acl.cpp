@@ -0,0 +1,296 @@
+#include "./type.hpp"
+
+#include <string.h>
+#include <ctype.h>
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+/* ================= private helpers ================= */
+
+namespace
+{
+    constexpr int direct_bits = 16;
+    constexpr int stride = 6;
+    constexpr uint32_t direct_leaf = 0x80000000u;
+
+    // bits [offset, offset + n) of a left aligned key, zero past the end
+    inline uint32_t extract(unsigned __int128 key, int offset, int n)
+    {
+        if (offset >= 128)
+            return 0;
+        return (uint32_t)((key << offset) >> (128 - n));
+    }
+
+    unsigned __int128 key_from_bytes(const unsigned char *bytes, int len)
+    {
+        unsigned __int128 key = 0;
+        for (int i = 0; i < len; ++i)
+            key |= (unsigned __int128)bytes[i] << (120 - 8 * i);
+        return key;
+    }
+
+    // covers slot range [first, last] of the `bits` wide level starting at depth
+    void slot_range(const Poptrie::Prefix &p, int depth, int bits, uint32_t &first, uint32_t &last)
+    {
+        int fixed = p.length - depth;
+        uint32_t head = fixed > 0 ? extract(p.key, depth, fixed) : 0;
+        first = head << (bits - fixed);
+        last = first | ((1u << (bits - fixed)) - 1);
+    }
+}
+
+/* ================= poptrie ================= */
+
+/**
+ * Fill one level: every slot either gets a child node (longer prefixes
+ * continue below it) or a leaf holding the best match so far.
+ * prefixes must be sorted by length so longer ones override shorter ones.
+ */
+void Poptrie::build_level(const std::vector<Prefix> &prefixes, int depth, int bits,
+                          uint8_t inherited, std::vector<uint8_t> &values,
+                          std::vector<std::vector<Prefix>> &below)
+{
+    size_t slots = (size_t)1 << bits;
+    values.assign(slots, inherited);
+    below.assign(slots, {});
+
+    for (const Prefix &p : prefixes)
+    {
+        if (p.length <= depth + bits)
+        {
+            uint32_t first, last;
+            slot_range(p, depth, bits, first, last);
+            std::fill(values.begin() + first, values.begin() + last + 1, p.action);
+        }
+        else
+        {
+            below[extract(p.key, depth, bits)].push_back(p);
+        }
+    }
+}
+
+void Poptrie::build_node(const std::vector<Prefix> &prefixes, int depth, uint8_t inherited, uint32_t index)
+{
+    std::vector<uint8_t> values;
+    std::vector<std::vector<Prefix>> below;
+    build_level(prefixes, depth, stride, inherited, values, below);
+
+    Node node{};
+    int children = 0;
+    bool have_leaf = false;
+    uint8_t last_leaf = 0;
+
+    node.leaf_base = leaves_.size();
+    for (uint32_t v = 0; v < 64; ++v)
+    {
+        if (!below[v].empty())
+        {
+            node.vector |= 1ull << v;
+            children++;
+            continue;
+        }
+        // leaf compression: only store where the value changes
+        if (!have_leaf || values[v] != last_leaf)
+        {
+            node.leafvec |= 1ull << v;
+            leaves_.push_back(values[v]);
+            last_leaf = values[v];
+            have_leaf = true;
+        }
+    }
+
+    // children of one node are contiguous so a popcount finds them
+    node.child_base = nodes_.size();
+    nodes_.resize(nodes_.size() + children);
+    nodes_[index] = node;
+
+    int c = 0;
+    for (uint32_t v = 0; v < 64; ++v)
+    {
+        if (!below[v].empty())
+            build_node(below[v], depth + stride, values[v], node.child_base + c++);
+    }
+}
+
+void Poptrie::build(std::vector<Prefix> prefixes)
+{
+    nodes_.clear();
+    leaves_.clear();
+    std::stable_sort(prefixes.begin(), prefixes.end(),
+                     [](const Prefix &a, const Prefix &b)
+                     { return a.length < b.length; });
+
+    std::vector<uint8_t> values;
+    std::vector<std::vector<Prefix>> below;
+    build_level(prefixes, 0, direct_bits, 0, values, below);
+
+    direct_.assign((size_t)1 << direct_bits, 0);
+    for (size_t v = 0; v < direct_.size(); ++v)
+    {
+        if (below[v].empty())
+            direct_[v] = direct_leaf | values[v];
+        else
+        {
+            uint32_t index = nodes_.size();
+            nodes_.emplace_back();
+            build_node(below[v], direct_bits, values[v], index);
+            direct_[v] = index;
+        }
+    }
+    nodes_.shrink_to_fit();
+    leaves_.shrink_to_fit();
+}
+
+uint8_t Poptrie::lookup(unsigned __int128 key) const
+{
+    uint32_t e = direct_[extract(key, 0, direct_bits)];
+    if (e & direct_leaf)
+        return e & 0xff;
+
+    const Node *node = &nodes_[e];
+    int offset = direct_bits;
+    uint32_t v = extract(key, offset, stride);
+    while (node->vector & (1ull << v))
+    {
+        node = &nodes_[node->child_base + __builtin_popcountll(node->vector & ((2ull << v) - 1)) - 1];
+        offset += stride;
+        v = extract(key, offset, stride);
+    }
+    return leaves_[node->leaf_base + __builtin_popcountll(node->leafvec & ((2ull << v) - 1)) - 1];
+}
+
+size_t Poptrie::memory() const
+{
+    return direct_.size() * sizeof(uint32_t) + nodes_.size() * sizeof(Node) + leaves_.size();
+}
+
+/* ================= CIDR ACL ================= */
+
+bool Cidr_acl::parse(const std::string &cidr, uint8_t action, Poptrie::Prefix &out, bool &v6)
+{
+    std::string addr = cidr;
+    bool has_length = false;
+    long length = 0;
+    size_t slash = cidr.find('/');
+    if (slash != std::string::npos)
+    {
+        // digits only: strtol would take "/-8" or "/+8" too
+        const char *digits = cidr.c_str() + slash + 1;
+        if (!isdigit((unsigned char)*digits))
+            return false;
+        addr = cidr.substr(0, slash);
+        char *end = nullptr;
+        length = strtol(digits, &end, 10);
+        if (*end != '\0')
+            return false;
+        has_length = true;
+    }
+
+    unsigned char bytes[16];
+    if (inet_pton(AF_INET, addr.c_str(), bytes) == 1)
+    {
+        v6 = false;
+        if (!has_length)
+            length = 32;
+        if (length > 32)
+            return false;
+        out.key = key_from_bytes(bytes, 4);
+    }
+    else if (inet_pton(AF_INET6, addr.c_str(), bytes) == 1)
+    {
+        v6 = true;
+        if (!has_length)
+            length = 128;
+        if (length > 128)
+            return false;
+        out.key = key_from_bytes(bytes, 16);
+        // mapped peers are looked up as IPv4: "::ffff:10.0.0.0/104" is 10.0.0.0/8
+        static const unsigned char mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+        if (length >= 96 && memcmp(bytes, mapped, sizeof(mapped)) == 0)
+        {
+            v6 = false;
+            length -= 96;
+            out.key = key_from_bytes(bytes + 12, 4);
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    // drop host bits so "10.1.2.3/8" means 10.0.0.0/8
+    if (length < 128)
+        out.key &= ~(~(unsigned __int128)0 >> length);
+    out.length = length;
+    out.action = action;
+    return true;
+}
+
+/**
+ * Compile allow/deny lists. Longest prefix wins; on an exact tie deny wins.
+ * return nullptr and set error on a malformed entry.
+ */
+std::unique_ptr<Cidr_acl> Cidr_acl::build(const std::vector<std::string> &allow,
+                                          const std::vector<std::string> &deny,
+                                          std::string &error)
+{
+    auto acl = std::make_unique<Cidr_acl>();
+    std::vector<Poptrie::Prefix> v4, v6;
+
+    // deny after allow: the stable sort keeps it last among equal lengths
+    for (int pass = 0; pass < 2; ++pass)
+    {
+        const auto &list = pass == 0 ? allow : deny;
+        uint8_t action = pass == 0 ? ACL_ALLOW : ACL_DENY;
+        for (const std::string &cidr : list)
+        {
+            Poptrie::Prefix p;
+            bool is_v6;
+            if (!parse(cidr, action, p, is_v6))
+            {
+                error = "invalid prefix \"" + cidr + "\"";
+                return nullptr;
+            }
+            (is_v6 ? v6 : v4).push_back(p);
+        }
+    }
+
+    acl->default_allow_ = allow.empty();
+    acl->prefixes_ = v4.size() + v6.size();
+    acl->v4_.build(std::move(v4));
+    acl->v6_.build(std::move(v6));
+    return acl;
+}
+
+bool Cidr_acl::permit(const sockaddr *addr) const
+{
+    uint8_t action;
+    if (addr->sa_family == AF_INET)
+    {
+        auto *in = reinterpret_cast<const sockaddr_in *>(addr);
+        action = v4_.lookup((unsigned __int128)ntohl(in->sin_addr.s_addr) << 96);
+    }
+    else if (addr->sa_family == AF_INET6)
+    {
+        auto *in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+        const unsigned char *b = in6->sin6_addr.s6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr))
+            action = v4_.lookup(key_from_bytes(b + 12, 4));
+        else
+            action = v6_.lookup(key_from_bytes(b, 16));
+    }
+    else
+    {
+        return default_allow_;
+    }
+
+    if (action == ACL_NONE)
+        return default_allow_;
+    return action == ACL_ALLOW;
+}
+
+size_t Cidr_acl::memory() const
+{
+    return v4_.memory() + v6_.memory();
+}
@@ -0,0 +1,71 @@
+#include "./type.hpp"
+
+#include <algorithm>
+
+Connection_table::Connection_table()
+    : size_(0)
+{
+}
+
+void Connection_table::index(int fd, ProxyConnection *conn)
+{
+    if ((size_t)fd >= by_fd_.size())
+        by_fd_.resize(std::max<size_t>(fd + 1, by_fd_.size() * 2), nullptr);
+    by_fd_[fd] = conn;
+}
+
+/**
+ * A zeroed slot for a new connection: the most recently freed one, whose
+ * lines are likeliest still in cache. A new chunk is only allocated once
+ * every slot of the existing ones is taken.
+ */
+ProxyConnection *Connection_table::create(int client_fd, Route *route)
+{
+    if (free_.empty())
+    {
+        uint32_t base = hot_.size() * CHUNK;
+        hot_.emplace_back(new ProxyConnection[CHUNK]);
+        cold_.emplace_back(new Connection_meta[CHUNK]);
+        // backwards, so pop_back() hands out the chunk in address order
+        for (size_t i = CHUNK; i > 0; --i)
+        {
+            hot_.back()[i - 1].client_fd = -1;
+            free_.push_back(base + i - 1);
+        }
+    }
+    uint32_t slot = free_.back();
+    free_.pop_back();
+
+    ProxyConnection *conn = &hot_[slot / CHUNK][slot % CHUNK];
+    *conn = ProxyConnection{};
+    conn->client_fd = client_fd;
+    conn->server_fd = -1;
+    conn->slot = slot;
+
+    Connection_meta &m = meta(conn);
+    m = Connection_meta{};
+    m.route = route;
+
+    index(client_fd, conn);
+    size_++;
+    return conn;
+}
+
+void Connection_table::set_server_fd(ProxyConnection *conn, int server_fd)
+{
+    conn->server_fd = server_fd;
+    if (server_fd >= 0)
+        index(server_fd, conn);
+}
+
+void Connection_table::destroy(ProxyConnection *conn)
+{
+    if (find(conn->client_fd) == conn)
+        by_fd_[conn->client_fd] = nullptr;
+    if (find(conn->server_fd) == conn)
+        by_fd_[conn->server_fd] = nullptr;
+    conn->client_fd = -1;
+    conn->server_fd = -1;
+    free_.push_back(conn->slot);
+    size_--;
+}
@@ -0,0 +1,353 @@
+#include "./coroutine.hpp"
+#include "./probes.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+
+#include <openssl/ssl.h>
+
+#include <spdlog/spdlog.h>
+
+thread_local Frame_pool frame_pool;
+
+/* ================= frame allocator ================= */
+
+Frame_pool::Frame_pool()
+    : allocated_(0)
+{
+}
+
+Frame_pool::~Frame_pool()
+{
+    for (auto &frames : free_)
+    {
+        for (void *frame : frames)
+            ::operator delete(frame);
+    }
+}
+
+void *Frame_pool::allocate(size_t size)
+{
+    size_t index = (size - 1) / GRAIN;
+    if (index >= CLASSES)
+        return ::operator new(size);
+    if (!free_[index].empty())
+    {
+        void *frame = free_[index].back();
+        free_[index].pop_back();
+        return frame;
+    }
+    allocated_++;
+    return ::operator new((index + 1) * GRAIN);
+}
+
+void Frame_pool::deallocate(void *frame, size_t size)
+{
+    size_t index = (size - 1) / GRAIN;
+    if (index >= CLASSES)
+    {
+        ::operator delete(frame);
+        return;
+    }
+    free_[index].push_back(frame);
+}
+
+/* ================= awaitables ================= */
+
+// Grown like Connection_table's fd index, never shrunk
+static Fd_waiter &waiter_of(Worker *worker, int fd)
+{
+    if ((size_t)fd >= worker->fd_waiters.size())
+        worker->fd_waiters.resize(std::max<size_t>(fd + 1, worker->fd_waiters.size() * 2));
+    return worker->fd_waiters[fd];
+}
+
+Io_wait::Io_wait(Worker *worker, int fd, int other)
+    : worker_(worker),
+      fds_{fd, other}
+{
+}
+
+bool Io_wait::await_ready()
+{
+    for (int fd : fds_)
+    {
+        if (fd >= 0 && waiter_of(worker_, fd).events)
+            return true;
+    }
+    return false;
+}
+
+void Io_wait::await_suspend(std::coroutine_handle<> task)
+{
+    for (int fd : fds_)
+    {
+        if (fd >= 0)
+            waiter_of(worker_, fd).task = task;
+    }
+}
+
+std::pair<uint32_t, uint32_t> Io_wait::await_resume()
+{
+    uint32_t events[2] = {0, 0};
+    for (int i = 0; i < 2; ++i)
+    {
+        if (fds_[i] < 0)
+            continue;
+        Fd_waiter &waiter = waiter_of(worker_, fds_[i]);
+        events[i] = waiter.events;
+        waiter = Fd_waiter{};
+    }
+    return {events[0], events[1]};
+}
+
+// An epoll event on fd: remember the edge, and run the task waiting for it
+void resume_connection_task(Worker *worker, int fd, uint32_t events)
+{
+    Fd_waiter &waiter = waiter_of(worker, fd);
+    waiter.events |= events;
+    // the task clears the slot once it runs; waiter may move meanwhile
+    if (std::coroutine_handle<> task = waiter.task)
+        task.resume();
+}
+
+// The coroutine counterpart of run_ready_list
+void run_ready_tasks(Worker *worker)
+{
+    size_t pending = worker->ready_tasks.size();
+    for (size_t i = 0; i < pending && !worker->ready_tasks.empty(); ++i)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        std::coroutine_handle<> task = worker->ready_tasks.front();
+        worker->ready_tasks.pop_front();
+        task.resume();
+    }
+}
+
+/* ================= connection steps ================= */
+
+/**
+ * align_between_connection with the log line for a mismatch.
+ * return: 0 protocol matches, 1 no byte yet, < 0 reject the client
+ */
+static int check_protocol(Worker *worker, ProxyConnection *conn)
+{
+    int ret = worker->server->align_between_connection(
+        conn->client_fd,
+        worker->conns.meta(conn).route->config.mode);
+
+    if (ret == -1)
+        spdlog::error("Client uses TLS but proxy is plaintext");
+    else if (ret == -2)
+        spdlog::error("Client is plaintext but proxy is TLS");
+    else if (ret == -3)
+        spdlog::info("Client closed connection");
+    else if (ret == 0)
+        conn->protocol_checked = true;
+    return ret;
+}
+
+/**
+ * Wait for the first byte of a TLS client and check it is a handshake.
+ * return: 0 go on, -1 close
+ */
+Task<int> async_sniff(Worker *worker, ProxyConnection *conn)
+{
+    while (true)
+    {
+        int ret = check_protocol(worker, conn);
+        if (ret < 0)
+            co_return -1;
+        if (ret == 0)
+            break;
+        co_await Io_wait(worker, conn->client_fd);
+    }
+    PROXY_PROBE1(handshake_start, conn->client_fd);
+    co_return 0;
+}
+
+/**
+ * SSL_accept until the client handshake is through.
+ * return: 0 done, -1 failed
+ */
+Task<int> async_accept_tls(Worker *worker, ProxyConnection *conn)
+{
+    while (true)
+    {
+        int ret = SSL_accept(conn->ssl);
+        if (ret == 1)
+            break;
+        int err = SSL_get_error(conn->ssl, ret);
+        if (err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE)
+        {
+            const Connection_meta &meta = worker->conns.meta(conn);
+            PROXY_PROBE3(handshake_end, conn->client_fd, 0, (clock_ns() - meta.accepted_ns) / 1000);
+            spdlog::error("TLS Handshake failed");
+            co_return -1;
+        }
+        co_await Io_wait(worker, conn->client_fd);
+    }
+    client_handshake_done(worker, conn);
+    co_return 0;
+}
+
+/**
+ * Non-blocking connect to the route's upstream, the task's counterpart of
+ * start_server_connect() and upstream_connected().
+ * return: 0 connected, -1 failed
+ */
+Task<int> async_connect(Worker *worker, ProxyConnection *conn)
+{
+    Proxy_server *server = worker->server;
+    Route &route = *worker->conns.meta(conn).route;
+
+    int server_fd = socket(route.upstream_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0)
+        co_return -1;
+    // close_connection takes care of it from here
+    worker->conns.set_server_fd(conn, server_fd);
+
+    // before connect(): buffer sizes decide the window scale in the SYN
+    apply_socket_options(server_fd, server->upstream_socket);
+    if (server->upstream_socket.fastopen > 0)
+    {
+        int one = 1;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0)
+            spdlog::warn("setsockopt TCP_FASTOPEN_CONNECT failed: {}", strerror(errno));
+    }
+    worker->enable_busy_poll(server_fd);
+    if (worker->add_epoll_event(server_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0)
+        co_return -1;
+
+    if (connect(server_fd, (sockaddr *)&route.upstream_addr, route.upstream_addr_len) < 0)
+    {
+        if (errno != EINPROGRESS)
+            co_return -1;
+        // writable once the SYN is answered, SO_ERROR tells how
+        while (!((co_await Io_wait(worker, server_fd)).first & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            ;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(server_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+            co_return -1;
+    }
+
+    if (route.upstream_context)
+    {
+        conn->upstream_ssl = server->create_upstream_ssl(server_fd, route);
+        if (!conn->upstream_ssl)
+            co_return -1;
+    }
+    else
+    {
+        worker->enable_zerocopy(server_fd);
+    }
+    if (worker->add_epoll_event(conn->client_fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0)
+        co_return -1;
+    conn->server_connected = true;
+    if (!conn->upstream_ssl)
+        mark_upstream_ready(worker, conn);
+    co_return 0;
+}
+
+/**
+ * TLS handshake with the upstream; client data waits in the socket.
+ * return: 0 done, -1 failed
+ */
+Task<int> async_upstream_tls(Worker *worker, ProxyConnection *conn)
+{
+    while (true)
+    {
+        int ret = worker->server->upstream_handshake(conn->upstream_ssl);
+        if (ret < 0)
+        {
+            spdlog::error("Upstream TLS handshake failed");
+            co_return -1;
+        }
+        if (ret == 0)
+            break;
+        co_await Io_wait(worker, conn->server_fd);
+    }
+    conn->upstream_handshaked = true;
+    mark_upstream_ready(worker, conn);
+    co_return 0;
+}
+
+/**
+ * Both directions until one side is done. A wake runs the directions its
+ * edges can move: a client edge reads the client, and resumes upstream ->
+ * client if that waits on the client becoming writable; same for the
+ * upstream. A plain client is sniffed here, on its first byte, so an
+ * upstream that speaks first is not held up.
+ * return: 0 closed, -1 error
+ */
+Task<int> async_relay(Worker *worker, ProxyConnection *conn)
+{
+    Connection_meta &meta = worker->conns.meta(conn);
+    bool from_client = true;
+    bool from_server = true;
+    while (true)
+    {
+        if (from_client && !conn->protocol_checked)
+        {
+            int ret = check_protocol(worker, conn);
+            if (ret < 0)
+                co_return 0;
+            from_client = ret == 0;
+        }
+
+        int in = from_client ? worker->handle_client_side(conn, meta) : 1;
+        int out = in > 0 && from_server ? worker->handle_server_side(conn, meta) : 1;
+        record_first_bytes(worker, meta);
+        if (in <= 0 || out <= 0)
+        {
+            int ret = in <= 0 ? in : out;
+            if (ret < 0)
+                spdlog::error("proxy connection error, fd={}", in < 0 ? conn->client_fd : conn->server_fd);
+            co_return ret;
+        }
+
+        if (in == 2 || out == 2)
+        {
+            co_await Next_turn{worker};
+            from_client = in == 2;
+            from_server = out == 2;
+            continue;
+        }
+        auto [client_events, server_events] = co_await Io_wait(worker, conn->client_fd, conn->server_fd);
+        from_client = client_events || (server_events && conn->to_server.size() > 0);
+        from_server = server_events || (client_events && conn->to_client.size() > 0);
+    }
+}
+
+/**
+ * A connection from open_connection to close_connection. Plain clients
+ * are connected at once, as in the state machine; TLS ones after their
+ * handshake.
+ */
+Detached serve_connection(Worker *worker, ProxyConnection *conn)
+{
+    int ret = 0;
+    if (conn->ssl)
+    {
+        if (!conn->protocol_checked)
+            ret = co_await async_sniff(worker, conn);
+        if (ret == 0)
+            ret = co_await async_accept_tls(worker, conn);
+    }
+    if (ret == 0)
+    {
+        ret = co_await async_connect(worker, conn);
+        if (ret < 0)
+            spdlog::error("Proxy side not working");
+    }
+    if (ret == 0 && conn->upstream_ssl)
+        ret = co_await async_upstream_tls(worker, conn);
+    if (ret == 0)
+        co_await async_relay(worker, conn);
+    close_connection(worker, conn);
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+/**
+ * C++20 coroutines on top of a worker's epoll loop, config.json
+ * "coroutines": true. A connection runs as one task that reads top to
+ * bottom: sniff, TLS accept, connect, upstream TLS, relay. Each step
+ * retries its syscall and co_awaits the next edge on the fd when the
+ * kernel says EAGAIN; the worker resumes the task from its event batch.
+ *
+ * Frames come from a per-thread pool of 64 byte size classes, so a
+ * connection costs no heap allocation once the pool is warm.
+ */
+
+#include "./type.hpp"
+
+#include <coroutine>
+#include <exception>
+#include <utility>
+
+/* ================= frame allocator ================= */
+
+class Frame_pool
+{
+private:
+    static const size_t GRAIN = 64;
+    static const size_t CLASSES = 32; // frames up to 2 KiB, larger ones use the heap
+
+    std::vector<void *> free_[CLASSES];
+    size_t allocated_;
+
+public:
+    Frame_pool();
+    ~Frame_pool();
+
+    void *allocate(size_t size);
+    void deallocate(void *frame, size_t size);
+    size_t allocated() const { return allocated_; }
+};
+
+// One per thread: a task is created, resumed and destroyed on its worker only
+extern thread_local Frame_pool frame_pool;
+
+// Promise base that puts the coroutine frame in frame_pool
+struct Pooled_frame
+{
+    static void *operator new(size_t size) { return frame_pool.allocate(size); }
+    static void operator delete(void *frame, size_t size) { frame_pool.deallocate(frame, size); }
+};
+
+/* ================= task types ================= */
+
+/**
+ * A step of a connection. Starts when awaited and resumes its awaiter
+ * when it returns, without growing the stack (symmetric transfer).
+ */
+template <typename T>
+class Task
+{
+public:
+    struct promise_type : Pooled_frame
+    {
+        T value{};
+        std::coroutine_handle<> continuation;
+
+        struct Final_awaiter
+        {
+            bool await_ready() noexcept { return false; }
+            std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+            {
+                return h.promise().continuation;
+            }
+            void await_resume() noexcept {}
+        };
+
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        Final_awaiter final_suspend() noexcept { return {}; }
+        void return_value(T v) { value = std::move(v); }
+        void unhandled_exception() { std::terminate(); }
+    };
+
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle_(handle) {}
+    Task(Task &&other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task(const Task &) = delete;
+    ~Task()
+    {
+        if (handle_)
+            handle_.destroy();
+    }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter) noexcept
+    {
+        handle_.promise().continuation = awaiter;
+        return handle_;
+    }
+    T await_resume() { return std::move(handle_.promise().value); }
+
+private:
+    std::coroutine_handle<promise_type> handle_;
+};
+
+// The top of a connection: runs at once and frees its own frame at the end
+struct Detached
+{
+    struct promise_type : Pooled_frame
+    {
+        Detached get_return_object() { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+};
+
+/* ================= awaitables ================= */
+
+/**
+ * The next edge on fd, or on either of two fds. Edges that came while the
+ * task was busy are kept in Worker::fd_waiters and complete the wait at
+ * once, edge triggered epoll would not report them again.
+ * Resumes with the events seen on each fd.
+ */
+class Io_wait
+{
+private:
+    Worker *worker_;
+    int fds_[2];
+
+public:
+    Io_wait(Worker *worker, int fd, int other = -1);
+
+    bool await_ready();
+    void await_suspend(std::coroutine_handle<> task);
+    std::pair<uint32_t, uint32_t> await_resume();
+};
+
+// Give the other connections a turn; resumed from run_ready_tasks()
+struct Next_turn
+{
+    Worker *worker;
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> task) { worker->ready_tasks.push_back(task); }
+    void await_resume() const noexcept {}
+};
+
+/* ================= connection steps ================= */
+
+Task<int> async_sniff(Worker *, ProxyConnection *);
+
+Task<int> async_accept_tls(Worker *, ProxyConnection *);
+
+Task<int> async_connect(Worker *, ProxyConnection *);
+
+Task<int> async_upstream_tls(Worker *, ProxyConnection *);
+
+Task<int> async_relay(Worker *, ProxyConnection *);
+
+Detached serve_connection(Worker *, ProxyConnection *);
+
+void resume_connection_task(Worker *, int, uint32_t);
+
+void run_ready_tasks(Worker *);
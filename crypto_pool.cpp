@@ -0,0 +1,85 @@
+#include "./type.hpp"
+
+#include <unistd.h>
+
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#include <spdlog/spdlog.h>
+
+Crypto_pool::Crypto_pool(int threads)
+    : stopping_(false)
+{
+    for (int i = 0; i < threads; ++i)
+        threads_.emplace_back(&Crypto_pool::run, this);
+}
+
+Crypto_pool::~Crypto_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        stopping_ = true;
+    }
+    jobs_cv_.notify_all();
+    for (auto &t : threads_)
+        t.join();
+}
+
+void Crypto_pool::submit(Worker *worker, ProxyConnection *conn)
+{
+    {
+        std::lock_guard<std::mutex> lock(jobs_mutex_);
+        jobs_.push_back(Handshake_job{worker, conn, 0, SSL_ERROR_NONE});
+    }
+    jobs_cv_.notify_one();
+}
+
+/**
+ * Drain the handshakes finished for worker; called from its loop when
+ * crypto_fd becomes readable.
+ */
+std::vector<Handshake_job> Crypto_pool::collect(Worker *worker)
+{
+    uint64_t count;
+    if (read(worker->crypto_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        spdlog::error("crypto pool eventfd read failed");
+
+    std::vector<Handshake_job> done;
+    std::lock_guard<std::mutex> lock(worker->crypto_mutex);
+    done.swap(worker->crypto_done);
+    return done;
+}
+
+void Crypto_pool::run()
+{
+    while (true)
+    {
+        Handshake_job job;
+        {
+            std::unique_lock<std::mutex> lock(jobs_mutex_);
+            jobs_cv_.wait(lock, [this]
+                          { return stopping_ || !jobs_.empty(); });
+            if (stopping_)
+                return;
+            job = jobs_.front();
+            jobs_.pop_front();
+        }
+
+        // the error queue is per thread, so classify the result here
+        ERR_clear_error();
+        SSL *ssl = job.conn->ssl;
+        job.ret = SSL_accept(ssl);
+        job.err = job.ret == 1 ? SSL_ERROR_NONE : SSL_get_error(ssl, job.ret);
+        if (job.err == SSL_ERROR_SSL)
+            ERR_print_errors_fp(stderr);
+
+        Worker *worker = job.worker;
+        {
+            std::lock_guard<std::mutex> lock(worker->crypto_mutex);
+            worker->crypto_done.push_back(job);
+        }
+        uint64_t one = 1;
+        if (write(worker->crypto_fd, &one, sizeof(one)) < 0)
+            spdlog::error("crypto pool eventfd write failed");
+    }
+}
@@ -23,6 +23,7 @@ After=network.target
 
 [Service]
 ExecStart=/usr/local/bin/proxy_server
+ExecReload=/bin/kill -HUP \$MAINPID
 Restart=always
 RestartSec=5
 User=root
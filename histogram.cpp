@@ -0,0 +1,86 @@
+#include "./type.hpp"
+
+#include <algorithm>
+
+/**
+ * Bucket of a value: values below SUB_BUCKETS get one bucket each, above
+ * that every power of two is split into SUB_BUCKETS equal steps, so the
+ * error stays under 1 / SUB_BUCKETS at any magnitude.
+ */
+size_t Latency_histogram::index(uint64_t value)
+{
+    if (value < SUB_BUCKETS)
+        return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BITS;
+    size_t sub = (value >> shift) & (SUB_BUCKETS - 1);
+    return (size_t)(shift + 1) * SUB_BUCKETS + sub;
+}
+
+// Upper edge of a bucket, what percentile() reports
+uint64_t Latency_histogram::value_at(size_t index)
+{
+    if (index < SUB_BUCKETS)
+        return index;
+    int shift = index / SUB_BUCKETS - 1;
+    uint64_t sub = index % SUB_BUCKETS;
+    return ((SUB_BUCKETS + sub + 1) << shift) - 1;
+}
+
+Latency_histogram::Latency_histogram()
+    : counts_{},
+      count_(0),
+      max_(0)
+{
+}
+
+void Latency_histogram::record(uint64_t value)
+{
+    counts_[std::min(index(value), BUCKETS - 1)]++;
+    count_++;
+    max_ = std::max(max_, value);
+}
+
+void Latency_histogram::merge(const Latency_histogram &other)
+{
+    for (size_t i = 0; i < BUCKETS; ++i)
+        counts_[i] += other.counts_[i];
+    count_ += other.count_;
+    max_ = std::max(max_, other.max_);
+}
+
+uint64_t Latency_histogram::percentile(double q) const
+{
+    if (count_ == 0)
+        return 0;
+    uint64_t rank = (uint64_t)(q / 100.0 * count_ + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i)
+    {
+        seen += counts_[i];
+        if (seen >= rank)
+            return std::min(value_at(i), max_);
+    }
+    return max_;
+}
+
+json Latency_histogram::summary() const
+{
+    return {{"count", count_},
+            {"p50", percentile(50)},
+            {"p90", percentile(90)},
+            {"p99", percentile(99)},
+            {"p999", percentile(99.9)},
+            {"max", max_}};
+}
+
+void Latency_metrics::merge(const Latency_metrics &other)
+{
+    handshake.merge(other.handshake);
+    upstream.merge(other.upstream);
+    first_byte.merge(other.first_byte);
+    lifetime.merge(other.lifetime);
+    loop.merge(other.loop);
+}
@@ -1,20 +1,29 @@
 
 #include <signal.h>
+#include <sys/signalfd.h>
 #include <iostream>
 #include <fstream>
 #include "./type.hpp"
+#include "./probes.hpp"
+#include "./coroutine.hpp"
 #include <typeinfo>
+#include <algorithm>
+#include <sstream>
 #include <nlohmann/json.hpp>
 #include <spdlog/spdlog.h>
+#include <openssl/err.h>
+#include <netinet/tcp.h>
+#include <sched.h>
 
 using json = nlohmann::json;
 using namespace std;
 
-std::map<int, std::unique_ptr<ProxyConnection>>
-    conns;
-
+// Default mode of routes that do not set "mode" (argv "tls")
 ProxyMode MODE;
 
+static void accept_client(Proxy_server *server, int listen_fd, Route *route);
+static void sniff_client(Proxy_server *server, int fd);
+
 int main(int argc, char *argv[])
 {
     signal(SIGPIPE, SIG_IGN);
@@ -53,225 +62,1382 @@ int main(int argc, char *argv[])
     std::cout << "- Setting file (config.json):" << std::endl;
     std::cout << j.dump() << std::endl;
 
-    Proxy_server server(config, MODE == MODE_TLS);
+    Proxy_server server(config);
+    server.start_workers();
+
+    // The main thread keeps the control fds; connections live on the workers
+    epoll_event events[64];
+    while (true)
+    {
+        // while draining, look every 100 ms whether the workers are done
+        int n = epoll_wait(server.ep_fd, events, 64, server.draining ? 100 : -1);
+
+        for (int i = 0; i < n; ++i)
+        {
+            int fd = events[i].data.fd;
+            if (Route *route = server.listener_route(fd))
+            {
+                accept_client(&server, fd, route);
+            }
+            else if (server.sniffing.count(fd))
+            {
+                sniff_client(&server, fd);
+            }
+            else if (fd == server.timer_fd)
+            {
+                server.report_metrics();
+            }
+            else if (fd == server.stats_fd)
+            {
+                server.publish_stats();
+            }
+            else if (fd == server.signal_fd)
+            {
+                signalfd_siginfo si;
+                while (read(server.signal_fd, &si, sizeof(si)) == sizeof(si))
+                {
+                    if (si.ssi_signo == SIGHUP)
+                        server.reload();
+                }
+            }
+            else if (fd == server.reload_fd)
+            {
+                server.install_contexts();
+            }
+            else if (server.admin && server.admin->owns(fd))
+            {
+                server.admin->handle(&server, fd, events[i].events);
+            }
+        }
+
+        if (server.draining && std::all_of(server.workers.begin(), server.workers.end(), [](const std::unique_ptr<Worker> &w)
+                                           { return w->finished.load(); }))
+        {
+            spdlog::info("drain complete, exiting");
+            break;
+        }
+    }
+    return 0;
+}
+
+/* ================= acceptor mode ================= */
+
+// worker was charged for a client that never reaches it
+static void release_handoff(Worker *worker, const Handoff &handoff)
+{
+    if (handoff.route->config.mode == MODE_TLS)
+        worker->handshakes--;
+    worker->load--;
+    if (worker->server->draining)
+        worker->wake();
+}
+
+static void hand_off(Worker *worker, const Handoff &handoff)
+{
+    if (!worker->inbox.push(handoff))
+    {
+        spdlog::warn("worker {}: handoff queue full, client dropped", worker->id);
+        shed_connection(handoff.fd);
+        release_handoff(worker, handoff);
+        return;
+    }
+    worker->wake();
+}
+
+/**
+ * Accept on the main thread and choose the worker right away, so clients
+ * still being sniffed count towards its load. TLS clients are sniffed
+ * here before they go over; plain ones go at once, their upstream may be
+ * the side that speaks first.
+ */
+static void accept_client(Proxy_server *server, int listen_fd, Route *route)
+{
+    sockaddr_storage peer{};
+    socklen_t peer_len = sizeof(peer);
+    int client_fd = accept4(listen_fd, (sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (client_fd < 0)
+        return;
+
+    if (!admit_connection(server, route, (sockaddr *)&peer))
+    {
+        shed_connection(client_fd);
+        return;
+    }
+    apply_socket_options(client_fd, server->client_socket);
+
+    // the worker on the CPU that took the SYN keeps the flow's cache lines local
+    Worker *worker = nullptr;
+    if (server->incoming_cpu)
+    {
+        int cpu = -1;
+        socklen_t len = sizeof(cpu);
+        if (getsockopt(client_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+            worker = server->worker_on_cpu(cpu);
+    }
+    if (!worker)
+        worker = server->least_loaded_worker();
+    Handoff handoff{client_fd, route, {}, clock_ns(), false, nullptr, 0};
+    memcpy(&handoff.peer, &peer, std::min<size_t>(peer_len, sizeof(handoff.peer)));
+    worker->load++;
+    if (route->config.mode != MODE_TLS)
+    {
+        hand_off(worker, handoff);
+        return;
+    }
+
+    worker->handshakes++;
+    if (server->add_epoll_event(client_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    {
+        close(client_fd);
+        release_handoff(worker, handoff);
+        return;
+    }
+    server->sniffing[client_fd] = {worker, handoff};
+}
+
+// The first byte of a client in acceptor mode; see align_between_connection
+static void sniff_client(Proxy_server *server, int fd)
+{
+    auto it = server->sniffing.find(fd);
+    auto [worker, handoff] = it->second;
+
+    int ret = server->align_between_connection(fd, handoff.route->config.mode);
+    if (ret > 0)
+        return;
+    epoll_ctl(server->ep_fd, EPOLL_CTL_DEL, fd, nullptr);
+    server->sniffing.erase(it);
+
+    if (ret < 0)
+    {
+        if (ret == -1)
+            spdlog::error("Client uses TLS but proxy is plaintext");
+        else if (ret == -2)
+            spdlog::error("Client is plaintext but proxy is TLS");
+        else
+            spdlog::info("Client closed connection");
+        close(fd);
+        release_handoff(worker, handoff);
+        return;
+    }
+    handoff.sniffed = true;
+    hand_off(worker, handoff);
+}
+
+/* ================= worker loop ================= */
+
+static void connection_event(Worker *worker, int fd, uint32_t events);
+
+/**
+ * Set up the connection of a client that belongs to worker from now on.
+ * The caller has already counted it in load, and in handshakes for TLS.
+ * return the connection, nullptr when it had to be closed at once or a
+ * connection task runs it.
+ */
+static ProxyConnection *open_connection(Worker *worker, const Handoff &handoff)
+{
+    Proxy_server *server = worker->server;
+    Route *route = handoff.route;
+    int client_fd = handoff.fd;
+    ProxyConnection *conn = worker->conns.create(client_fd, route);
+    Connection_meta &meta = worker->conns.meta(conn);
+    meta.peer = handoff.peer;
+    meta.accepted_ns = handoff.accepted_ns;
+    // a queued handshake was counted and sampled, or tapped from the admin socket, when it was new
+    if (handoff.ssl)
+    {
+        meta.tap_id = handoff.tap_id;
+    }
+    else
+    {
+        worker->totals.accepted++;
+        if (worker->tap && server->tap.sample > 0 && worker->tap_seen++ % server->tap.sample == 0)
+            meta.tap_id = worker->tap->open(meta);
+    }
+
+    worker->enable_busy_poll(client_fd);
+    worker->add_epoll_event(client_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
 
+    if (route->config.mode == MODE_TLS)
+    {
+        conn->ssl = handoff.ssl ? handoff.ssl : server->create_client_ssl(client_fd, *route);
+        if (!conn->ssl)
+        {
+            spdlog::error("SSL_new failed");
+            worker->handshakes--;
+            close_connection(worker, conn);
+            return nullptr;
+        }
+    }
+    else
+    {
+        worker->enable_zerocopy(client_fd);
+    }
+    // a connection task connects by itself
+    if (route->config.mode != MODE_TLS && !server->coroutines)
+    {
+        int ret = start_server_connect(worker, conn);
+        printf("connect server response: c_ret - %d,  server_fd - %d \n", ret, conn->server_fd);
+        if (ret < 0)
+        {
+            spdlog::error("Proxy side not working");
+            close_connection(worker, conn);
+            return nullptr;
+        }
+        if (ret == 0 && upstream_connected(worker, conn) < 0)
+            return nullptr;
+    }
+
+    conn->protocol_checked = handoff.sniffed;
+    // a queued handshake was announced by the worker it came from
+    if (!handoff.ssl)
+    {
+        PROXY_PROBE2(accept, client_fd, route->config.name.c_str());
+        if (handoff.sniffed && conn->ssl)
+            PROXY_PROBE1(handshake_start, client_fd);
+    }
+    if (server->coroutines)
+    {
+        // the task owns conn from here and may have closed it already
+        serve_connection(worker, conn);
+        return nullptr;
+    }
+    return conn;
+}
+
+/* ================= handshake stealing ================= */
+
+/**
+ * Park the first SSL_accept of conn in the worker's handshake queue, out
+ * of its epoll set and connection table, so an idle worker can take it.
+ */
+static void queue_handshake(Worker *worker, ProxyConnection *conn)
+{
+    const Connection_meta &meta = worker->conns.meta(conn);
+    // a thief goes on with the same tap conn_id in its own ring
+    Handoff handoff{conn->client_fd, meta.route, meta.peer, meta.accepted_ns, true, conn->ssl, meta.tap_id};
+    epoll_ctl(worker->ep_fd, EPOLL_CTL_DEL, conn->client_fd, nullptr);
+    worker->conns.destroy(conn);
+
+    std::lock_guard<std::mutex> lock(worker->steal_mutex);
+    worker->handshake_queue.push_back(handoff);
+    worker->queued++;
+}
+
+// Adopt a queued handshake and run its first SSL_accept
+static void run_queued_handshake(Worker *worker, const Handoff &handoff)
+{
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    ProxyConnection *conn = open_connection(worker, handoff);
+    if (!conn)
+        return;
+    int ret = SSL_accept(conn->ssl);
+    finish_client_handshake(worker, conn, ret, SSL_get_error(conn->ssl, ret));
+}
+
+// The owner works its queue from the front, after the batch that filled it
+static void run_handshake_queue(Worker *worker)
+{
+    while (true)
+    {
+        Handoff handoff;
+        {
+            std::lock_guard<std::mutex> lock(worker->steal_mutex);
+            if (worker->handshake_queue.empty())
+                return;
+            handoff = worker->handshake_queue.front();
+            worker->handshake_queue.pop_front();
+            worker->queued--;
+        }
+        run_queued_handshake(worker, handoff);
+    }
+}
+
+/**
+ * One idle worker per queued handshake: worth_queueing parked them for
+ * those. The owner drains the queue from the front meanwhile, thieves take
+ * from the back, so a woken worker may find nothing left.
+ */
+static void wake_thieves(Worker *worker)
+{
+    size_t extra = worker->queued;
+    for (auto &other : worker->server->workers)
+    {
+        if (extra == 0)
+            return;
+        if (other.get() != worker && other->idle)
+        {
+            other->idle = false;
+            other->wake();
+            extra--;
+        }
+    }
+}
+
+/**
+ * Whether parking a handshake can pay off: a queue already waits, and a new
+ * one must not pass it, or another worker is idle and may take it. With
+ * every worker busy, running it now costs less than the round trip.
+ */
+static bool worth_queueing(Worker *worker)
+{
+    if (worker->queued > 0)
+        return true;
+    for (auto &other : worker->server->workers)
+    {
+        if (other.get() != worker && other->idle)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * Take the newest queued handshake of the worker with the longest queue.
+ * The connection stays with the thief for good.
+ * return false when there was nothing to take.
+ */
+static bool steal_handshake(Worker *thief)
+{
+    Worker *victim = nullptr;
+    size_t longest = 0;
+    for (auto &worker : thief->server->workers)
+    {
+        size_t queued = worker->queued;
+        if (worker.get() != thief && queued > longest)
+        {
+            victim = worker.get();
+            longest = queued;
+        }
+    }
+    if (!victim)
+        return false;
+
+    Handoff handoff;
+    {
+        std::lock_guard<std::mutex> lock(victim->steal_mutex);
+        if (victim->handshake_queue.empty())
+            return false;
+        handoff = victim->handshake_queue.back();
+        victim->handshake_queue.pop_back();
+        victim->queued--;
+    }
+    thief->load++;
+    thief->handshakes++;
+    victim->handshakes--;
+    victim->load--;
+    if (thief->server->draining)
+        victim->wake();
+    thief->server->metrics.stolen_handshakes++;
+    run_queued_handshake(thief, handoff);
+    return true;
+}
+
+/**
+ * epoll_wait that first spins with timeout 0 for the worker's busy_poll_us:
+ * an event arriving inside the window is picked up without a wakeup and a
+ * context switch, at the price of a core that never sleeps under load.
+ */
+static int wait_events(Worker *worker, epoll_event *events, int max, int timeout)
+{
+    if (timeout == 0 || worker->busy_poll_us == 0)
+        return epoll_wait(worker->ep_fd, events, max, timeout);
+
+    uint64_t deadline = clock_ns() + (uint64_t)worker->busy_poll_us * 1000;
+    do
+    {
+        int n = epoll_wait(worker->ep_fd, events, max, 0);
+        if (n != 0)
+            return n;
+    } while (clock_ns() < deadline);
+    return epoll_wait(worker->ep_fd, events, max, timeout);
+}
+
+/**
+ * The event loop of one worker. Runs until the proxy drains and the last
+ * connection of this worker is gone.
+ */
+void worker_loop(Worker *worker)
+{
+    Proxy_server *server = worker->server;
+    worker->place();
     epoll_event events[1024];
+    bool stole = false;
     while (true)
     {
-        int n = epoll_wait(server.ep_fd, events, 1024, -1);
+        int timeout = worker->ready_conns.empty() && worker->ready_tasks.empty() && !stole ? -1 : 0;
+        worker->idle = timeout < 0;
+        int n = wait_events(worker, events, 1024, timeout);
+        worker->idle = false;
+        uint64_t woke_ns = clock_ns();
 
         for (int i = 0; i < n; ++i)
         {
+            // per event, not per batch: the admin socket and the metrics
+            // timer lock every worker and must not wait out a whole batch
+            std::lock_guard<std::mutex> lock(worker->mutex);
             int fd = events[i].data.fd;
-            if (fd == server.listen_fd)
+            if (Route *route = worker->listener_route(fd))
             {
                 // --------------- Accept from Client ---------------
-                int client_fd = accept(server.listen_fd, nullptr, nullptr);
+                sockaddr_storage peer{};
+                socklen_t peer_len = sizeof(peer);
+                int client_fd = accept4(fd, (sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
                 if (client_fd < 0)
                     continue;
 
-                auto conn = std::make_unique<ProxyConnection>();
-                conn->client_fd = client_fd;
-                conn->server_fd = -1;
-                conn->ssl = nullptr;
-                conn->server_connected = false;
-                conn->protocol_checked = false;
-
-                server.set_nonblocking(client_fd);
-                server.add_epoll_event(client_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLET);
-
-                if (MODE == MODE_TLS)
+                if (!admit_connection(server, route, (sockaddr *)&peer))
                 {
-                    conn->ssl = SSL_new(server.context);
-                    SSL_set_fd(conn->ssl, client_fd);
+                    shed_connection(client_fd);
+                    continue;
                 }
-                else
+                apply_socket_options(client_fd, server->client_socket);
+
+                worker->load++;
+                if (route->config.mode == MODE_TLS)
+                    worker->handshakes++;
+                Handoff handoff{client_fd, route, {}, clock_ns(), false, nullptr, 0};
+                memcpy(&handoff.peer, &peer, std::min<size_t>(peer_len, sizeof(handoff.peer)));
+                open_connection(worker, handoff);
+            }
+            else if (fd == worker->event_fd)
+            {
+                uint64_t count;
+                if (read(worker->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+                    spdlog::error("worker {}: eventfd read failed", worker->id);
+
+                Handoff handoff;
+                while (worker->inbox.pop(handoff))
                 {
-                    Server_connect_res s_res = start_server_connect(&server, *conn, config);
-                    printf("connect server response: c_ret - %d,  server_fd - %d \n", s_res.c_ret, s_res.server_fd);
-                    if (s_res.c_ret < 0)
-                    {
-                        spdlog::error("Proxy side not working");
-                        close_connection(conn.get());
-                        continue;
-                    }
-                    conn->server_fd = s_res.server_fd;
-                    conn->server_connected = true;
+                    // the byte that was sniffed is waiting already
+                    if (open_connection(worker, handoff) && handoff.sniffed)
+                        connection_event(worker, handoff.fd, EPOLLIN);
                 }
-
-                conns[client_fd] = std::move(conn);
+                if (server->draining)
+                    worker->close_listeners();
             }
-            else
+            else if (fd == worker->crypto_fd)
             {
-                ProxyConnection *conn = find_conn_by_fd(fd);
-                if (!conn)
-                    continue;
-                if (fd == conn->client_fd && MODE == MODE_TLS && !conn->ssl_accepted)
+                for (Handshake_job &job : server->crypto_pool->collect(worker))
                 {
-                    int ret = SSL_accept(conn->ssl);
-                    if (ret < 0)
+                    ProxyConnection *conn = job.conn;
+                    conn->handshake_in_flight = false;
+
+                    if (job.err == SSL_ERROR_WANT_READ || job.err == SSL_ERROR_WANT_WRITE)
                     {
-                        int err = SSL_get_error(conn->ssl, ret);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                        {
-                            continue;
-                        }
-                        else
+                        if (conn->handshake_rearm)
                         {
-                            spdlog::error("TLS Handshake failed");
-                            close_connection(conn);
-                            continue;
+                            conn->handshake_rearm = false;
+                            conn->handshake_in_flight = true;
+                            server->crypto_pool->submit(worker, conn);
                         }
+                        continue;
                     }
-                    conn->ssl_accepted = true;
-                    spdlog::info("TLS Handshake success");
-                    Server_connect_res s_res = start_server_connect(&server, *conn, config);
+                    conn->handshake_rearm = false;
 
-                    if (s_res.c_ret < 0)
-                    {
-                        spdlog::error("Proxy side not working");
-                        close_connection(conn);
+                    if (finish_client_handshake(worker, conn, job.ret, job.err) != 0)
                         continue;
-                    }
-                    conn->server_fd = s_res.server_fd;
-                    conn->server_connected = true;
+                    // Application data may already sit in the SSL buffer
+                    if (conn->server_connected && (!conn->upstream_ssl || conn->upstream_handshaked))
+                        relay_event(worker, conn, conn->client_fd);
                 }
-                if (fd == conn->client_fd && !conn->protocol_checked)
-                {
-                    int ret = server.align_between_connection(
-                        conn->client_fd,
-                        MODE);
+            }
+            else
+            {
+                connection_event(worker, fd, events[i].events);
+            }
+        }
 
-                    if (ret == -1)
-                    {
-                        spdlog::error("Client uses TLS but proxy is plaintext");
-                        close_connection(conn);
-                        continue;
-                    }
-                    if (ret == -2)
-                    {
-                        spdlog::error("Client is plaintext but proxy is TLS");
-                        close_connection(conn);
-                        continue;
-                    }
-                    if (ret == -3)
-                    {
-                        spdlog::info("Client closed connection");
-                        close_connection(conn);
-                        continue;
-                    }
+        stole = false;
+        if (server->handshake_stealing)
+        {
+            wake_thieves(worker);
+            run_handshake_queue(worker);
+            stole = steal_handshake(worker);
+        }
 
-                    if (ret == 0)
-                    {
-                        conn->protocol_checked = true;
-                    }
-                    continue;
-                }
-                else if ((fd == conn->server_fd || fd == conn->client_fd) && conn->server_connected)
-                {
-                    int ret;
+        run_ready_list(worker);
+        run_ready_tasks(worker);
+        uint64_t done_ns = clock_ns();
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->latency.loop.record((done_ns - woke_ns) / 1000);
+            worker->totals.batches++;
+            worker->publish_stats(done_ns);
+        }
 
-                    if (fd == conn->client_fd)
-                    {
-                        ret = server.handle_client_side(
-                            conn->ssl,
-                            conn->client_fd,
-                            conn->server_fd);
-                    }
-                    else
-                    {
-                        ret = server.handle_server_side(
-                            conn->ssl,
-                            conn->client_fd,
-                            conn->server_fd);
-                    }
+        if (server->draining && worker->load == 0)
+            break;
+    }
+    worker->finished = true;
+}
 
-                    if (ret == 0)
-                    {
-                        close_connection(conn);
-                    }
-                    else if (ret < 0)
-                    {
-                        spdlog::error("proxy connection error, fd={}", fd);
-                        close_connection(conn);
-                    }
-                }
+// An event on one side of a connection, in the order its phases come
+static void connection_event(Worker *worker, int fd, uint32_t events)
+{
+    Proxy_server *server = worker->server;
+
+    // zerocopy completions, possibly for a socket whose connection is gone
+    if ((events & EPOLLERR) && server->zerocopy_threshold > 0)
+        worker->reap_zerocopy(fd);
+
+    ProxyConnection *conn = worker->conns.find(fd);
+    if (!conn)
+        return;
+    if (server->coroutines)
+    {
+        resume_connection_task(worker, fd, events);
+        return;
+    }
+    // The first byte decides TLS or plaintext, so sniff before SSL_accept consumes it
+    if (fd == conn->client_fd && !conn->protocol_checked)
+    {
+        int ret = server->align_between_connection(
+            conn->client_fd,
+            worker->conns.meta(conn).route->config.mode);
+
+        if (ret == -1)
+        {
+            spdlog::error("Client uses TLS but proxy is plaintext");
+            close_connection(worker, conn);
+            return;
+        }
+        if (ret == -2)
+        {
+            spdlog::error("Client is plaintext but proxy is TLS");
+            close_connection(worker, conn);
+            return;
+        }
+        if (ret == -3)
+        {
+            spdlog::info("Client closed connection");
+            close_connection(worker, conn);
+            return;
+        }
+        if (ret != 0)
+            return;
+
+        conn->protocol_checked = true;
+        if (conn->ssl)
+            PROXY_PROBE1(handshake_start, conn->client_fd);
+    }
+    if (fd == conn->client_fd && conn->ssl && !conn->ssl_accepted)
+    {
+        if (server->crypto_pool)
+        {
+            // An edge seen while a crypto thread owns the SSL must not be lost
+            if (conn->handshake_in_flight)
+            {
+                conn->handshake_rearm = true;
+                return;
             }
+            conn->handshake_in_flight = true;
+            server->metrics.offloaded_handshakes++;
+            server->crypto_pool->submit(worker, conn);
+            return;
+        }
+        // nothing ran on the SSL yet: the costly first flight can move
+        if (server->handshake_stealing && SSL_in_before(conn->ssl) && worth_queueing(worker))
+        {
+            queue_handshake(worker, conn);
+            return;
+        }
+
+        int ret = SSL_accept(conn->ssl);
+        if (finish_client_handshake(worker, conn, ret, SSL_get_error(conn->ssl, ret)) != 0)
+            return;
+    }
+    if (fd == conn->server_fd && !conn->server_connected)
+    {
+        // writable once the SYN is answered, SO_ERROR tells how
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        if (upstream_connected(worker, conn) < 0)
+            return;
+        // Edge triggered: nothing re-announces what the client sent meanwhile
+        if ((!conn->upstream_ssl || conn->upstream_handshaked) && conn->protocol_checked &&
+            relay_event(worker, conn, conn->client_fd) <= 0)
+            return;
+    }
+    if (conn->server_connected && conn->upstream_ssl && !conn->upstream_handshaked)
+    {
+        // Client data stays queued until the upstream leg is ready; the
+        // handshake itself is driven by events on server_fd only
+        if (fd != conn->server_fd)
+            return;
+
+        int ret = server->upstream_handshake(conn->upstream_ssl);
+        if (ret < 0)
+        {
+            spdlog::error("Upstream TLS handshake failed");
+            close_connection(worker, conn);
+            return;
         }
+        if (ret > 0)
+            return;
+
+        conn->upstream_handshaked = true;
+        mark_upstream_ready(worker, conn);
+
+        // Edge triggered: nothing re-announces what the client sent meanwhile
+        if (conn->protocol_checked && relay_event(worker, conn, conn->client_fd) <= 0)
+            return;
+    }
+    if ((fd == conn->server_fd || fd == conn->client_fd) && conn->server_connected)
+    {
+        // Already waiting on the ready list, it gets its turn there,
+        // unless data is stuck on fd becoming writable
+        if ((fd == conn->client_fd && conn->client_ready && conn->to_client.size() == 0) ||
+            (fd == conn->server_fd && conn->server_ready && conn->to_server.size() == 0))
+            return;
+
+        relay_event(worker, conn, fd);
+    }
+}
+
+/**
+ * Continue a client TLS handshake after SSL_accept returned ret (err is
+ * its SSL_get_error) and connect upstream once it is done.
+ * return:
+ *   0   -> handshake done, upstream connected or connecting
+ *   1   -> handshake in progress
+ *  -1   -> connection closed
+ */
+int finish_client_handshake(Worker *worker, ProxyConnection *conn, int ret, int err)
+{
+    Connection_meta &meta = worker->conns.meta(conn);
+    if (ret <= 0)
+    {
+        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+            return 1;
+
+        PROXY_PROBE3(handshake_end, conn->client_fd, 0, (clock_ns() - meta.accepted_ns) / 1000);
+        spdlog::error("TLS Handshake failed");
+        close_connection(worker, conn);
+        return -1;
     }
+    client_handshake_done(worker, conn);
+    int connect_ret = start_server_connect(worker, conn);
+
+    if (connect_ret < 0)
+    {
+        spdlog::error("Proxy side not working");
+        close_connection(worker, conn);
+        return -1;
+    }
+    if (connect_ret == 0 && upstream_connected(worker, conn) < 0)
+        return -1;
     return 0;
 }
 
-Server_connect_res start_server_connect(Proxy_server *server, const ProxyConnection &conn, Config config)
+// SSL_accept succeeded: count it and take the timestamp
+void client_handshake_done(Worker *worker, ProxyConnection *conn)
 {
-    int server_fd = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_fd < 0)
+    Connection_meta &meta = worker->conns.meta(conn);
+    conn->ssl_accepted = true;
+    worker->handshakes--;
+    worker->totals.handshakes++;
+    meta.handshake_ns = clock_ns();
+    worker->latency.handshake.record((meta.handshake_ns - meta.accepted_ns) / 1000);
+    PROXY_PROBE3(handshake_end, conn->client_fd, 1, (meta.handshake_ns - meta.accepted_ns) / 1000);
+    spdlog::info("TLS Handshake success");
+}
+
+/**
+ * The upstream TCP connect is over, SO_ERROR tells how. Starts TLS with
+ * the upstream when the route has it: the ClientHello leaves now, events
+ * on server_fd drive the rest of the handshake.
+ * return: 0 connected, -1 connection closed
+ */
+int upstream_connected(Worker *worker, ProxyConnection *conn)
+{
+    Proxy_server *server = worker->server;
+    Route &route = *worker->conns.meta(conn).route;
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if (getsockopt(conn->server_fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+    {
+        spdlog::error("Proxy side not working: {}", strerror(err));
+        close_connection(worker, conn);
+        return -1;
+    }
+    if (route.upstream_context)
+    {
+        conn->upstream_ssl = server->create_upstream_ssl(conn->server_fd, route);
+        if (!conn->upstream_ssl)
+        {
+            spdlog::error("SSL_new failed");
+            close_connection(worker, conn);
+            return -1;
+        }
+    }
+    else
+    {
+        worker->enable_zerocopy(conn->server_fd);
+    }
+    conn->server_connected = true;
+    if (conn->upstream_ssl)
+    {
+        int ret = server->upstream_handshake(conn->upstream_ssl);
+        if (ret < 0)
+        {
+            spdlog::error("Upstream TLS handshake failed");
+            close_connection(worker, conn);
+            return -1;
+        }
+        if (ret > 0)
+            return 0;
+        conn->upstream_handshaked = true;
+    }
+    mark_upstream_ready(worker, conn);
+    return 0;
+}
+
+// The upstream leg is usable: connected, and through its TLS handshake if any
+void mark_upstream_ready(Worker *worker, ProxyConnection *conn)
+{
+    Connection_meta &meta = worker->conns.meta(conn);
+    meta.upstream_ns = clock_ns();
+    uint64_t from = meta.handshake_ns ? meta.handshake_ns : meta.accepted_ns;
+    worker->latency.upstream.record((meta.upstream_ns - from) / 1000);
+    PROXY_PROBE3(upstream_connect, conn->client_fd, conn->server_fd, (meta.upstream_ns - from) / 1000);
+}
+
+// Timestamps of the first byte each way, once a relay moved any
+void record_first_bytes(Worker *worker, Connection_meta &meta)
+{
+    if (!meta.first_in_ns && meta.bytes_in > 0)
+        meta.first_in_ns = clock_ns();
+    if (!meta.first_out_ns && meta.bytes_out > 0)
+    {
+        meta.first_out_ns = clock_ns();
+        worker->latency.first_byte.record((meta.first_out_ns - meta.upstream_ns) / 1000);
+    }
+}
+
+// One direction of conn; closes it on EOF or error and queues it when out of budget
+static int relay_direction(Worker *worker, ProxyConnection *conn, bool from_client)
+{
+    Connection_meta &meta = worker->conns.meta(conn);
+    int ret = from_client ? worker->handle_client_side(conn, meta) : worker->handle_server_side(conn, meta);
+    // before a close below frees conn
+    record_first_bytes(worker, meta);
+
+    if (ret == 0)
+    {
+        close_connection(worker, conn);
+    }
+    else if (ret < 0)
+    {
+        spdlog::error("proxy connection error, fd={}", from_client ? conn->client_fd : conn->server_fd);
+        close_connection(worker, conn);
+    }
+    else if (ret == 2)
+    {
+        // EPOLLET will not report this data again, so remember it ourselves
+        bool queued = conn->client_ready || conn->server_ready;
+        if (from_client)
+            conn->client_ready = true;
+        else
+            conn->server_ready = true;
+        if (!queued)
+            worker->ready_conns.push_back(conn);
+    }
+    return ret;
+}
+
+/**
+ * Relay whatever is readable on fd to the other side of conn. The event
+ * may also mean fd became writable, so a direction stalled on it resumes.
+ * Closes the connection on EOF or error; return value follows
+ * handle_client_side / handle_server_side.
+ */
+int relay_event(Worker *worker, ProxyConnection *conn, int fd)
+{
+    bool from_client = fd == conn->client_fd;
+    int ret = relay_direction(worker, conn, from_client);
+    if (ret <= 0)
+        return ret;
+
+    const Pending_data &waiting = from_client ? conn->to_client : conn->to_server;
+    if (waiting.size() > 0)
+    {
+        int other = relay_direction(worker, conn, !from_client);
+        if (other <= 0)
+            return other;
+    }
+    return ret;
+}
+
+/**
+ * Give every connection that ran out of budget one more turn, after the
+ * epoll batch has been served. Anything still not drained goes to the back.
+ */
+void run_ready_list(Worker *worker)
+{
+    size_t pending = worker->ready_conns.size();
+    for (size_t i = 0; i < pending && !worker->ready_conns.empty(); ++i)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        ProxyConnection *conn = worker->ready_conns.front();
+        worker->ready_conns.pop_front();
+
+        bool client = conn->client_ready;
+        bool server_side = conn->server_ready;
+        conn->client_ready = false;
+        conn->server_ready = false;
+
+        if (client && relay_event(worker, conn, conn->client_fd) <= 0)
+            continue;
+        if (server_side)
+            relay_event(worker, conn, conn->server_fd);
+    }
+}
+
+/**
+ * Admission control, checked before any per-connection state exists.
+ * Runs on whichever thread accepts; the limits count every worker.
+ * return false when the new connection has to be shed.
+ */
+bool admit_connection(Proxy_server *server, const Route *route, const sockaddr *peer)
+{
+    if (!std::atomic_load(&server->acl)->permit(peer))
+    {
+        server->metrics.shed_acl++;
+        return false;
+    }
+    size_t max_connections = server->max_connections;
+    if (max_connections > 0 && server->connection_count() >= max_connections)
+    {
+        server->metrics.shed_connection_limit++;
+        return false;
+    }
+    size_t max_handshakes = server->max_handshakes;
+    if (route->config.mode == MODE_TLS && max_handshakes > 0 && server->handshake_count() >= max_handshakes)
     {
-        Server_connect_res res;
-        res.c_ret = -1;
-        res.server_fd = -1;
-        return res;
+        server->metrics.shed_handshake_limit++;
+        return false;
     }
+    uint64_t now = monotonic_ns();
+    // per address first, so one abusive client cannot drain the global bucket
+    if (!server->ip_limiter.allow(peer, now))
+    {
+        server->metrics.shed_ip_rate++;
+        return false;
+    }
+    bool taken;
+    {
+        std::lock_guard<std::mutex> lock(server->accept_mutex);
+        taken = server->accept_bucket.take(now);
+    }
+    if (!taken)
+    {
+        server->metrics.shed_accept_rate++;
+        return false;
+    }
+    return true;
+}
+
+// Reset instead of a graceful close: no TIME_WAIT, the client learns at once
+void shed_connection(int fd)
+{
+    linger lg{};
+    lg.l_onoff = 1;
+    lg.l_linger = 0;
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    close(fd);
+}
+
+/**
+ * Re-read config.json and swap in what can change at runtime; runs on
+ * the reload thread, see Proxy_server::reload(). A config that fails to
+ * parse or compile leaves the running one in place.
+ */
+void reload_config(Proxy_server *server)
+{
+    Config config;
+    try
+    {
+        std::ifstream f("./config.json");
+        config = json::parse(f).get<Config>();
+    }
+    catch (const std::exception &e)
+    {
+        spdlog::error("reload: config.json rejected: {}", e.what());
+        return;
+    }
+
+    std::string error;
+    std::unique_ptr<Cidr_acl> acl = Cidr_acl::build(config.allow, config.deny, error);
+    if (!acl)
+    {
+        spdlog::error("reload: allow/deny list rejected: {}", error);
+        return;
+    }
+    spdlog::info("reload: allow/deny list now {} prefixes ({} KB)", acl->prefixes(), acl->memory() / 1024);
+    // workers admitting right now finish with the old list
+    std::atomic_store(&server->acl, std::shared_ptr<const Cidr_acl>(std::move(acl)));
+}
+
+static const char *connection_state(const ProxyConnection *conn)
+{
+    if (conn->ssl && !conn->ssl_accepted)
+        return "handshake";
+    if (conn->server_fd >= 0 && !conn->server_connected)
+        return "upstream_connect";
+    if (conn->upstream_ssl && !conn->upstream_handshaked)
+        return "upstream_handshake";
+    return "relay";
+}
 
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(config.proxy_pass);
-    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+/**
+ * One admin socket command, answered with a single JSON line:
+ *   stats | conns | reload | drain | log_level <level> | set <limit> <value>
+ */
+std::string admin_command(Proxy_server *server, const std::string &line)
+{
+    std::istringstream in(line);
+    std::string cmd, arg;
+    in >> cmd >> arg;
+    json reply;
 
-    int ret = connect(server_fd, (sockaddr *)&addr, sizeof(addr));
-    if (ret >= 0)
+    if (cmd == "stats")
     {
-        printf("client_f: %d, server_f: %d \n", conn.client_fd, server_fd);
-        server->set_nonblocking(server_fd);
-        if (server->add_epoll_event(conn.client_fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0 ||
-            server->add_epoll_event(server_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0)
+        uint64_t bytes_in = 0, bytes_out = 0, relay_reads = 0, relay_writes = 0;
+        size_t ready = 0, pool_blocks = 0, zerocopy_pinned = 0;
+        uint64_t tap_records = 0, tap_dropped = 0;
+        Latency_metrics latency;
+        json workers = json::array();
+        for (auto &worker : server->workers)
         {
-            perror("add epoll event problem... (create bridge)");
-            exit(EXIT_FAILURE);
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            uint64_t worker_in = 0, worker_out = 0;
+            worker->conns.for_each([&](const ProxyConnection *, const Connection_meta &meta)
+                                   {
+                                       worker_in += meta.bytes_in;
+                                       worker_out += meta.bytes_out;
+                                   });
+            bytes_in += worker_in;
+            bytes_out += worker_out;
+            relay_reads += worker->totals.relay_reads;
+            relay_writes += worker->totals.relay_writes;
+            ready += worker->ready_conns.size() + worker->ready_tasks.size();
+            pool_blocks += worker->buffer_pool.allocated();
+            zerocopy_pinned += worker->zerocopy_sockets.size();
+            latency.merge(worker->latency);
+            if (worker->tap)
+            {
+                tap_records += worker->tap->records();
+                tap_dropped += worker->tap->dropped();
+            }
+            workers.push_back({{"cpu", worker->cpu},
+                               {"busy_poll_us", worker->busy_poll_us},
+                               {"connections", worker->conns.size()},
+                               {"load", worker->load.load()},
+                               {"pending_handshakes", worker->handshakes.load()},
+                               {"queued_handshakes", worker->queued.load()},
+                               {"ready", worker->ready_conns.size() + worker->ready_tasks.size()},
+                               {"bytes_in", worker_in},
+                               {"bytes_out", worker_out}});
+        }
+        reply["connections"] = server->connection_count();
+        reply["pending_handshakes"] = server->handshake_count();
+        reply["ready"] = ready;
+        reply["draining"] = server->draining.load();
+        reply["bytes_in"] = bytes_in;
+        reply["bytes_out"] = bytes_out;
+        reply["workers"] = workers;
+        reply["max_connections"] = server->max_connections.load();
+        reply["max_handshakes"] = server->max_handshakes.load();
+        reply["relay_budget"] = server->relay_budget.load();
+        reply["buffer_size"] = server->buffer_size;
+        reply["log_level"] = spdlog::level::to_string_view(spdlog::get_level()).data();
+        reply["client_verify_ok"] = server->metrics.client_verify_ok.load();
+        reply["client_verify_failed"] = server->metrics.client_verify_failed.load();
+        reply["offloaded_handshakes"] = server->metrics.offloaded_handshakes.load();
+        reply["stolen_handshakes"] = server->metrics.stolen_handshakes.load();
+        reply["shed_acl"] = server->metrics.shed_acl.load();
+        reply["shed_connection_limit"] = server->metrics.shed_connection_limit.load();
+        reply["shed_handshake_limit"] = server->metrics.shed_handshake_limit.load();
+        reply["shed_accept_rate"] = server->metrics.shed_accept_rate.load();
+        reply["shed_ip_rate"] = server->metrics.shed_ip_rate.load();
+        reply["relay_reads"] = relay_reads;
+        reply["relay_writes"] = relay_writes;
+        reply["zerocopy_sends"] = server->metrics.zerocopy_sends.load();
+        reply["zerocopy_copied"] = server->metrics.zerocopy_copied.load();
+        reply["zerocopy_pinned_sockets"] = zerocopy_pinned;
+        reply["pool_blocks"] = pool_blocks;
+        if (!server->tap.path.empty())
+            reply["tap"] = {{"records", tap_records}, {"dropped", tap_dropped}};
+        reply["latency_us"] = {{"handshake", latency.handshake.summary()},
+                               {"upstream", latency.upstream.summary()},
+                               {"first_byte", latency.first_byte.summary()},
+                               {"lifetime", latency.lifetime.summary()},
+                               {"loop", latency.loop.summary()}};
+    }
+    else if (cmd == "conns")
+    {
+        uint64_t now = clock_ns();
+        reply = json::array();
+        for (auto &worker : server->workers)
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            worker->conns.for_each([&](const ProxyConnection *conn, const Connection_meta &meta)
+                                   { reply.push_back({{"worker", worker->id},
+                                                      {"route", meta.route->config.name},
+                                                      {"peer", format_socket_address(&meta.peer.sa)},
+                                                      {"client_fd", conn->client_fd},
+                                                      {"server_fd", conn->server_fd},
+                                                      {"state", connection_state(conn)},
+                                                      {"age_ms", (now - meta.accepted_ns) / 1000000},
+                                                      {"bytes_in", meta.bytes_in},
+                                                      {"bytes_out", meta.bytes_out},
+                                                      {"tapped", meta.tap_id != 0}}); });
+        }
+    }
+    else if (cmd == "reload")
+    {
+        server->reload();
+        reply["ok"] = true;
+    }
+    else if (cmd == "drain")
+    {
+        server->drain();
+        reply["ok"] = true;
+        reply["connections"] = server->connection_count();
+    }
+    else if (cmd == "tap" || cmd == "untap")
+    {
+        // by client_fd, as "conns" lists it; fds are unique across workers
+        int fd = -1;
+        std::istringstream(arg) >> fd;
+        if (server->tap.path.empty())
+            reply["error"] = "no tap configured";
+        else
+            reply["error"] = "no connection with client_fd \"" + arg + "\"";
+        for (auto &worker : server->workers)
+        {
+            std::lock_guard<std::mutex> lock(worker->mutex);
+            ProxyConnection *conn = worker->tap && fd >= 0 ? worker->conns.find(fd) : nullptr;
+            if (!conn || conn->client_fd != fd)
+                continue;
+            Connection_meta &meta = worker->conns.meta(conn);
+            if (cmd == "tap" && !meta.tap_id)
+                meta.tap_id = worker->tap->open(meta);
+            if (cmd == "untap" && meta.tap_id)
+            {
+                worker->tap->close(meta.tap_id);
+                meta.tap_id = 0;
+            }
+            reply = {{"ok", true}, {"conn_id", meta.tap_id}};
+            break;
+        }
+    }
+    else if (cmd == "log_level")
+    {
+        spdlog::level::level_enum level = spdlog::level::from_str(arg);
+        // from_str answers "off" for anything it does not know
+        if (level == spdlog::level::off && arg != "off")
+            reply["error"] = "unknown log level \"" + arg + "\"";
+        else
+        {
+            spdlog::set_level(level);
+            reply["ok"] = true;
+        }
+    }
+    else if (cmd == "set")
+    {
+        long long value = -1;
+        if (!(in >> value) || value < 0)
+            reply["error"] = "usage: set <limit> <value>";
+        else if (arg == "max_connections")
+            server->max_connections = value;
+        else if (arg == "max_handshakes")
+            server->max_handshakes = value;
+        else if (arg == "relay_budget")
+            server->relay_budget = value;
+        // pending data of a read goes into a pool block: both change together
+        else if (arg == "buffer_size" && value >= 512)
+        {
+            server->buffer_size = value;
+            for (auto &worker : server->workers)
+            {
+                std::lock_guard<std::mutex> lock(worker->mutex);
+                worker->relay_buffer.resize(value);
+                worker->buffer_pool.configure(value);
+            }
+        }
+        else
+            reply["error"] = "cannot set \"" + arg + "\"";
+
+        if (!reply.contains("error"))
+        {
+            spdlog::info("admin: {} set to {}", arg, value);
+            reply["ok"] = true;
         }
-        spdlog::info("accept clinet connect, start proxy to server");
     }
     else
     {
-        close(server_fd);
+        reply["error"] = "unknown command \"" + cmd + "\"";
+    }
+    return reply.dump();
+}
+
+/**
+ * Non-blocking connect to the route's upstream. From here server_fd is in
+ * the worker's epoll set and belongs to conn, close_connection closes it.
+ * return:
+ *   0   -> connected, upstream_connected() is next
+ *   1   -> in progress, EPOLLOUT on server_fd finishes it
+ *  -1   -> failed
+ */
+int start_server_connect(Worker *worker, ProxyConnection *conn)
+{
+    Proxy_server *server = worker->server;
+    Route &route = *worker->conns.meta(conn).route;
+
+    int server_fd = socket(route.upstream_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server_fd < 0)
+        return -1;
+    worker->conns.set_server_fd(conn, server_fd);
+
+    // before connect(): buffer sizes decide the window scale in the SYN
+    apply_socket_options(server_fd, server->upstream_socket);
+    if (server->upstream_socket.fastopen > 0)
+    {
+        // connect() returns at once, the SYN leaves with the first write
+        int one = 1;
+        if (setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one, sizeof(one)) < 0)
+            spdlog::warn("setsockopt TCP_FASTOPEN_CONNECT failed: {}", strerror(errno));
+    }
+
+    int ret = connect(server_fd, (sockaddr *)&route.upstream_addr, route.upstream_addr_len);
+    if (ret < 0 && errno != EINPROGRESS)
+        return -1;
+
+    // added after connect(): a socket not connecting yet polls as hung up
+    printf("client_f: %d, server_f: %d \n", conn->client_fd, server_fd);
+    worker->enable_busy_poll(server_fd);
+    if (worker->add_epoll_event(conn->client_fd, EPOLL_CTL_MOD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0 ||
+        worker->add_epoll_event(server_fd, EPOLL_CTL_ADD, EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP | EPOLLERR) < 0)
+    {
+        perror("add epoll event problem... (create bridge)");
+        exit(EXIT_FAILURE);
     }
-    Server_connect_res res;
-    res.c_ret = ret;
-    res.server_fd = server_fd;
-    return res;
+    spdlog::info("accept clinet connect, start proxy to server");
+    return ret < 0 ? 1 : 0;
 }
 
-void close_connection(const ProxyConnection *conn)
+// Microseconds from a to b, or -1 when b was never reached
+static long long phase_us(uint64_t a, uint64_t b)
+{
+    return a && b ? (long long)(b - a) / 1000 : -1;
+}
+
+/**
+ * Lifetime histogram for every connection; a full trace record for one in
+ * trace_sample of them.
+ */
+void trace_connection(Worker *worker, const ProxyConnection *conn, const Connection_meta &meta)
+{
+    uint64_t now = clock_ns();
+    worker->latency.lifetime.record((now - meta.accepted_ns) / 1000);
+    PROXY_PROBE4(close, conn->client_fd, meta.bytes_in, meta.bytes_out, (now - meta.accepted_ns) / 1000);
+
+    size_t sample = worker->server->trace_sample;
+    if (sample == 0 || worker->traced++ % sample != 0)
+        return;
+    spdlog::info("trace: route={} peer={} handshake_us={} upstream_us={} first_in_us={} first_out_us={} "
+                 "lifetime_us={} bytes_in={} bytes_out={}",
+                 meta.route->config.name,
+                 format_socket_address(&meta.peer.sa),
+                 phase_us(meta.accepted_ns, meta.handshake_ns),
+                 phase_us(meta.handshake_ns ? meta.handshake_ns : meta.accepted_ns, meta.upstream_ns),
+                 phase_us(meta.accepted_ns, meta.first_in_ns),
+                 phase_us(meta.upstream_ns, meta.first_out_ns),
+                 phase_us(meta.accepted_ns, now),
+                 meta.bytes_in,
+                 meta.bytes_out);
+}
+
+void close_connection(Worker *worker, ProxyConnection *conn)
 {
     printf("close connect between %d and %d \n", conn->client_fd, conn->server_fd);
-    close(conn->client_fd);
+    if (conn->ssl != nullptr && !conn->ssl_accepted)
+        worker->handshakes--;
+    const Connection_meta &meta = worker->conns.meta(conn);
+    worker->totals.closed++;
+    trace_connection(worker, conn, meta);
+    if (meta.tap_id)
+        worker->tap->close(meta.tap_id);
+    worker->close_socket(conn->client_fd);
     if (conn->ssl != nullptr)
     {
         SSL_shutdown(conn->ssl);
         SSL_free(conn->ssl);
     }
+    if (conn->upstream_ssl != nullptr)
+    {
+        SSL_shutdown(conn->upstream_ssl);
+        SSL_free(conn->upstream_ssl);
+    }
     if (conn->server_fd > 0)
     {
-        close(conn->server_fd);
+        worker->close_socket(conn->server_fd);
     }
-    conns.erase(conn->client_fd);
+    if (conn->to_client.block)
+        worker->buffer_pool.put(conn->to_client.block);
+    if (conn->to_server.block)
+        worker->buffer_pool.put(conn->to_server.block);
+    if (conn->client_ready || conn->server_ready)
+    {
+        auto it = std::find(worker->ready_conns.begin(), worker->ready_conns.end(), conn);
+        if (it != worker->ready_conns.end())
+            worker->ready_conns.erase(it);
+    }
+    // Errors are queued per thread; once handshakes run elsewhere nothing else
+    // clears what this connection left behind for the next SSL_get_error
+    ERR_clear_error();
+    worker->conns.destroy(conn);
+    worker->load--;
 }
 
-ProxyConnection *find_conn_by_fd(int fd)
+void from_json(const json &j, Socket_options &opts)
 {
-    for (auto &[_, conn] : conns)
+    static const char *const keys[] = {"nodelay", "sndbuf", "rcvbuf", "keepalive", "keepidle", "keepintvl",
+                                       "keepcnt", "user_timeout", "notsent_lowat", "fastopen", "defer_accept"};
+    int *fields[] = {&opts.nodelay, &opts.sndbuf, &opts.rcvbuf, &opts.keepalive, &opts.keepidle, &opts.keepintvl,
+                     &opts.keepcnt, &opts.user_timeout, &opts.notsent_lowat, &opts.fastopen, &opts.defer_accept};
+    static_assert(sizeof(keys) / sizeof(keys[0]) == sizeof(Socket_options) / sizeof(int), "socket option without a key");
+
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i)
     {
-        if (conn->client_fd == fd || conn->server_fd == fd)
-            return conn.get();
+        // booleans read as 1/0 so "nodelay": true works
+        *fields[i] = -1;
+        if (j.contains(keys[i]))
+            *fields[i] = j.at(keys[i]).is_boolean() ? (int)j.at(keys[i]).get<bool>() : j.at(keys[i]).get<int>();
+        if (*fields[i] < -1)
+            throw std::invalid_argument(std::string("socket_options: ") + keys[i] + " must not be negative");
+    }
+    // a misspelt option would otherwise be ignored without a word
+    for (auto &[key, _] : j.items())
+    {
+        if (std::find_if(std::begin(keys), std::end(keys), [&](const char *k)
+                         { return key == k; }) == std::end(keys))
+            throw std::invalid_argument("socket_options: unknown option \"" + key + "\"");
     }
-    return nullptr;
+}
+
+void from_json(const json &j, Route_config &route)
+{
+    // "listen" takes a list of addresses; without it bind server_listen on IPv4 as before
+    if (j.contains("listen"))
+        j.at("listen").get_to(route.listen);
+    else
+        route.listen = {"0.0.0.0:" + std::to_string(j.at("server_listen").get<int>())};
+    route.name = j.value("name", route.listen.empty() ? std::string("") : route.listen.front());
+
+    std::string mode = j.value("mode", std::string(MODE == MODE_TLS ? "tls" : "plain"));
+    if (mode != "tls" && mode != "plain")
+        throw std::invalid_argument("route " + route.name + ": mode must be \"tls\" or \"plain\"");
+    route.mode = mode == "tls" ? MODE_TLS : MODE_PLAN;
+
+    route.path = j.value("path", std::string("./security"));
+    route.client_ca = j.value("client_ca", std::string(""));
+    j.at("proxy_pass").get_to(route.proxy_pass);
+    // Optional keys fall back to the single local backend without TLS
+    route.proxy_host = j.value("proxy_host", std::string("127.0.0.1"));
+    route.upstream_tls = j.value("upstream_tls", false);
+    route.upstream_ca = j.value("upstream_ca", std::string(""));
+    route.upstream_sni = j.value("upstream_sni", std::string(""));
+}
+
+void from_json(const json &j, Tap_options &tap)
+{
+    tap.path = j.value("path", std::string(""));
+    long long size = j.value("size", 64ll << 20);
+    int sample = j.value("sample", 0);
+    int snaplen = j.value("snaplen", 0);
+    if (size < 65536)
+        throw std::invalid_argument("tap: size must be at least 65536");
+    if (sample < 0 || snaplen < 0)
+        throw std::invalid_argument("tap: sample and snaplen must not be negative");
+    tap.size = size;
+    tap.sample = sample;
+    tap.snaplen = snaplen;
 }
 
 void from_json(const json &j, Config &config)
 {
-    // Use .at() to access keys; it throws an exception if the key is missing
-    j.at("path").get_to(config.path);
-    j.at("server_listen").get_to(config.server_listen);
-    j.at("proxy_pass").get_to(config.proxy_pass);
-    // You can also use j.get<std::string>() or other types directly
-}
\ No newline at end of file
+    // "routes" serves many listen -> upstream pairs; otherwise the top level is the only route
+    if (j.contains("routes"))
+        j.at("routes").get_to(config.routes);
+    else
+        config.routes = {j.get<Route_config>()};
+    config.ipv6_only = j.value("ipv6_only", false);
+    config.verify_cache_ttl = j.value("verify_cache_ttl", 300);
+    config.verify_cache_size = j.value("verify_cache_size", 10000);
+    config.metrics_interval = j.value("metrics_interval", 60);
+    config.crypto_threads = j.value("crypto_threads", 0);
+    config.relay_budget = j.value("relay_budget", 0);
+    config.max_connections = j.value("max_connections", 0);
+    config.max_handshakes = j.value("max_handshakes", 0);
+    config.accept_rate = j.value("accept_rate", 0);
+    config.accept_burst = j.value("accept_burst", 0);
+    config.ip_rate = j.value("ip_rate", 0);
+    config.ip_burst = j.value("ip_burst", 0);
+    config.ip_table_size = j.value("ip_table_size", 65536);
+    config.ip_table_shards = j.value("ip_table_shards", 16);
+    config.buffer_size = j.value("buffer_size", 65536);
+    // 0 keeps every plain send a copy
+    config.zerocopy_threshold = j.value("zerocopy_threshold", 0);
+    // 1 in N closed connections logs a trace record, 0 = none
+    config.trace_sample = j.value("trace_sample", 0);
+    // event loop threads; "reuseport": each accepts for itself, "acceptor": the main thread hands clients out
+    config.workers = j.value("workers", 1);
+    if (config.workers < 1)
+        throw std::invalid_argument("workers must be at least 1");
+    std::string accept_mode = j.value("accept_mode", std::string("reuseport"));
+    if (accept_mode != "reuseport" && accept_mode != "acceptor")
+        throw std::invalid_argument("accept_mode must be \"reuseport\" or \"acceptor\"");
+    config.accept_mode = accept_mode == "acceptor" ? ACCEPT_ACCEPTOR : ACCEPT_REUSEPORT;
+    // idle workers take over queued TLS handshakes from busy ones
+    config.handshake_stealing = j.value("handshake_stealing", false);
+    // worker i runs on worker_cpus[i % size]; empty leaves placement to the scheduler
+    config.worker_cpus = j.value("worker_cpus", std::vector<int>{});
+    for (int cpu : config.worker_cpus)
+    {
+        if (cpu < 0 || cpu >= CPU_SETSIZE)
+            throw std::invalid_argument("worker_cpus: " + std::to_string(cpu) + " is not a CPU number");
+    }
+    // worker memory from the node the worker runs on
+    config.numa_local = j.value("numa_local", false);
+    // clients go to the worker pinned on the CPU that received them
+    config.incoming_cpu = j.value("incoming_cpu", false);
+    // one budget for every worker, or a list taken round-robin like worker_cpus
+    json busy_poll = j.value("busy_poll_us", json::array());
+    config.busy_poll_us = busy_poll.is_array() ? busy_poll.get<std::vector<int>>() : std::vector<int>{busy_poll.get<int>()};
+    for (int us : config.busy_poll_us)
+    {
+        if (us < 0)
+            throw std::invalid_argument("busy_poll_us must not be negative");
+    }
+    // one coroutine per connection instead of the flag driven dispatch
+    config.coroutines = j.value("coroutines", false);
+    config.admin_socket = j.value("admin_socket", std::string(""));
+    // counters and gauges in a shared memory file for tools/proxy_top
+    config.stats_path = j.value("stats_path", std::string(""));
+    config.stats_interval_ms = j.value("stats_interval_ms", 100);
+    if (config.stats_interval_ms <= 0)
+        throw std::invalid_argument("stats_interval_ms must be positive");
+    // "socket_options": {"client": {...}, "upstream": {...}, "listener": {...}}
+    json sockets = j.value("socket_options", json::object());
+    config.client_socket = sockets.value("client", json::object()).get<Socket_options>();
+    config.upstream_socket = sockets.value("upstream", json::object()).get<Socket_options>();
+    config.listener_socket = sockets.value("listener", json::object()).get<Socket_options>();
+    if (config.client_socket.defer_accept >= 0 || config.upstream_socket.defer_accept >= 0)
+        throw std::invalid_argument("socket_options: defer_accept applies to the listener only");
+    if (config.client_socket.fastopen >= 0)
+        throw std::invalid_argument("socket_options: fastopen applies to the listener or upstream");
+    config.tap = j.value("tap", json::object()).get<Tap_options>();
+    config.allow = j.value("allow", std::vector<std::string>{});
+    config.deny = j.value("deny", std::vector<std::string>{});
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+/**
+ * USDT probes, provider "proxy_server". Built against sys/sdt.h (package
+ * systemtap-sdt-dev / systemtap-sdt-devel) each probe is one nop plus a
+ * note in the ELF that perf and bpftrace attach to. The Makefile checks
+ * for the header once and passes -DHAVE_SDT; without it the probes compile
+ * to nothing and `make build` says so, since bpftrace/ would then find no
+ * probes. -DPROXY_NO_PROBES leaves them out on purpose.
+ *
+ *   accept            (client_fd, route name)
+ *   handshake_start   (client_fd)
+ *   handshake_end     (client_fd, ok, us since accept)
+ *   upstream_connect  (client_fd, server_fd, us since the client was ready)
+ *   relay             (src_fd, dst_fd, bytes, to_client)
+ *   backpressure      (src_fd, dst_fd, bytes left pending)
+ *   close             (client_fd, bytes_in, bytes_out, lifetime us)
+ *
+ * See bpftrace/ for scripts built on these.
+ */
+
+#if defined(HAVE_SDT) && !defined(PROXY_NO_PROBES)
+#include <sys/sdt.h>
+
+#define PROXY_PROBE1(name, a) DTRACE_PROBE1(proxy_server, name, a)
+#define PROXY_PROBE2(name, a, b) DTRACE_PROBE2(proxy_server, name, a, b)
+#define PROXY_PROBE3(name, a, b, c) DTRACE_PROBE3(proxy_server, name, a, b, c)
+#define PROXY_PROBE4(name, a, b, c, d) DTRACE_PROBE4(proxy_server, name, a, b, c, d)
+
+#else
+
+#define PROXY_PROBE1(name, a) \
+    do                        \
+    {                         \
+        (void)(a);            \
+    } while (0)
+#define PROXY_PROBE2(name, a, b) \
+    do                           \
+    {                            \
+        (void)(a);               \
+        (void)(b);               \
+    } while (0)
+#define PROXY_PROBE3(name, a, b, c) \
+    do                              \
+    {                               \
+        (void)(a);                  \
+        (void)(b);                  \
+        (void)(c);                  \
+    } while (0)
+#define PROXY_PROBE4(name, a, b, c, d) \
+    do                                 \
+    {                                  \
+        (void)(a);                     \
+        (void)(b);                     \
+        (void)(c);                     \
+        (void)(d);                     \
+    } while (0)
+
+#endif
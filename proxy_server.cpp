@@ -1,40 +1,170 @@
 #include "./type.hpp"
+#include "./probes.hpp"
 
 #include <stdio.h>
 #include <iostream>
 #include <unistd.h>
 #include <string.h>
 #include <signal.h>
+#include <sched.h>
 #include <sys/socket.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
 #include <errno.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <linux/errqueue.h>
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include <openssl/x509.h>
 
 #include <spdlog/spdlog.h>
+#include <spdlog/fmt/ranges.h>
 
 /* ================= private helpers ================= */
 
-int Proxy_server::create_socket()
+/**
+ * Parse "0.0.0.0:443", "[::]:443" or "[::1]:8443" style addresses.
+ * return false when host or port is not numeric.
+ */
+bool parse_socket_address(const std::string &text, sockaddr_storage &addr, socklen_t &len)
+{
+    size_t colon = text.rfind(':');
+    if (colon == std::string::npos || colon + 1 == text.size())
+        return false;
+
+    std::string host = text.substr(0, colon);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    char *end = nullptr;
+    long port = strtol(text.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port <= 0 || port > 65535)
+        return false;
+
+    addr = {};
+    auto *in = reinterpret_cast<sockaddr_in *>(&addr);
+    auto *in6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+    if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) == 1)
+    {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        len = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, host.c_str(), &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        len = sizeof(sockaddr_in6);
+        return true;
+    }
+    return false;
+}
+
+// "1.2.3.4:80" or "[::1]:80", the form parse_socket_address reads
+std::string format_socket_address(const sockaddr *addr)
+{
+    char host[INET6_ADDRSTRLEN] = "";
+    if (addr->sa_family == AF_INET)
+    {
+        auto *in = reinterpret_cast<const sockaddr_in *>(addr);
+        inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+        return std::string(host) + ":" + std::to_string(ntohs(in->sin_port));
+    }
+    if (addr->sa_family == AF_INET6)
+    {
+        auto *in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+        return "[" + std::string(host) + "]:" + std::to_string(ntohs(in6->sin6_port));
+    }
+    return "?";
+}
+
+static int set_int_option(int fd, int level, int name, int value, const char *what)
+{
+    if (value < 0)
+        return 0;
+    if (setsockopt(fd, level, name, &value, sizeof(value)) < 0)
+    {
+        spdlog::warn("setsockopt {}={} failed: {}", what, value, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Apply every option that is set. A failing option is logged and skipped.
+ * return: number of options the kernel refused
+ */
+int apply_socket_options(int fd, const Socket_options &opts)
+{
+    int failed = 0;
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_NODELAY, opts.nodelay, "TCP_NODELAY");
+    failed -= set_int_option(fd, SOL_SOCKET, SO_SNDBUF, opts.sndbuf, "SO_SNDBUF");
+    failed -= set_int_option(fd, SOL_SOCKET, SO_RCVBUF, opts.rcvbuf, "SO_RCVBUF");
+    failed -= set_int_option(fd, SOL_SOCKET, SO_KEEPALIVE, opts.keepalive, "SO_KEEPALIVE");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_KEEPIDLE, opts.keepidle, "TCP_KEEPIDLE");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_KEEPINTVL, opts.keepintvl, "TCP_KEEPINTVL");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_KEEPCNT, opts.keepcnt, "TCP_KEEPCNT");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, opts.user_timeout, "TCP_USER_TIMEOUT");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, opts.notsent_lowat, "TCP_NOTSENT_LOWAT");
+    failed -= set_int_option(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, opts.defer_accept, "TCP_DEFER_ACCEPT");
+    return failed;
+}
+
+/**
+ * A listen socket on address. reuseport lets one socket per worker share
+ * the port, the kernel spreading new connections by flow hash.
+ */
+int Proxy_server::create_socket(const std::string &address, bool reuseport)
 {
-    int s;
-    struct sockaddr_in addr = {};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(this->proxy_server_ip);
-    addr.sin_addr.s_addr = INADDR_ANY;
+    sockaddr_storage addr;
+    socklen_t addr_len;
+    if (!parse_socket_address(address, addr, addr_len))
+    {
+        spdlog::error("invalid listen address \"{}\"", address);
+        exit(EXIT_FAILURE);
+    }
 
-    s = socket(AF_INET, SOCK_STREAM, 0);
+    int s = socket(addr.ss_family, SOCK_STREAM, 0);
     if (s < 0)
     {
         spdlog::error("socket creation problem...");
         exit(EXIT_FAILURE);
     }
 
-    if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+    // restarts must not wait for TIME_WAIT of the previous process
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport && setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
     {
-        spdlog::error("binding problem...");
+        spdlog::error("SO_REUSEPORT problem...");
+        exit(EXIT_FAILURE);
+    }
+
+    if (addr.ss_family == AF_INET6)
+    {
+        // off: "[::]:port" serves IPv4 as v4-mapped addresses too
+        int v6only = ipv6_only_ ? 1 : 0;
+        if (setsockopt(s, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0)
+        {
+            spdlog::error("IPV6_V6ONLY problem...");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // buffer sizes must be in place before listen() to shape the window scale
+    apply_socket_options(s, listener_socket_);
+    set_int_option(s, IPPROTO_TCP, TCP_FASTOPEN, listener_socket_.fastopen, "TCP_FASTOPEN");
+
+    if (bind(s, (struct sockaddr *)&addr, addr_len) < 0)
+    {
+        spdlog::error("binding problem... ({})", address);
         exit(EXIT_FAILURE);
     }
 
@@ -44,50 +174,429 @@ int Proxy_server::create_socket()
         exit(EXIT_FAILURE);
     }
 
+    spdlog::info("listening on {}", address);
     return s;
 }
 
-SSL_CTX *Proxy_server::create_context()
+/**
+ * Resolve a route's proxy_host once; numeric IPv4/IPv6 or a host name.
+ */
+void Proxy_server::resolve_upstream(Route &route)
+{
+    const Route_config &config = route.config;
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo *res = nullptr;
+
+    std::string port = std::to_string(config.proxy_pass);
+    int err = getaddrinfo(config.proxy_host.c_str(), port.c_str(), &hints, &res);
+    if (err != 0 || !res)
+    {
+        spdlog::error("can't resolve proxy_host \"{}\": {}", config.proxy_host, gai_strerror(err));
+        exit(EXIT_FAILURE);
+    }
+    memcpy(&route.upstream_addr, res->ai_addr, res->ai_addrlen);
+    route.upstream_addr_len = res->ai_addrlen;
+    freeaddrinfo(res);
+}
+
+/**
+ * Build the server SSL_CTX of a route from its certificate files.
+ * return nullptr when they do not load; safe to call off the loop thread.
+ */
+SSL_CTX *Proxy_server::create_context(Route &route)
 {
+    const Route_config &config = route.config;
     const SSL_METHOD *method = TLS_server_method();
     SSL_CTX *ctx = SSL_CTX_new(method);
     if (!ctx)
     {
         spdlog::error("SSL_CTX creation failed");
         ERR_print_errors_fp(stderr);
-        exit(EXIT_FAILURE);
+        return nullptr;
     }
-    if (SSL_CTX_use_certificate_file(ctx, (this->cert_path + "/server.crt").c_str(), SSL_FILETYPE_PEM) <= 0)
+    // relay() retries a blocked SSL_write from its pending copy, and takes
+    // every record that went out as progress
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE);
+    // an idle tunnel gives its ~34 KB of record buffers back until data moves
+    SSL_CTX_set_mode(ctx, SSL_MODE_RELEASE_BUFFERS);
+
+    if (SSL_CTX_use_certificate_file(ctx, (config.path + "/server.crt").c_str(), SSL_FILETYPE_PEM) <= 0)
     {
-        spdlog::error("load certificate failed");
-        exit(EXIT_FAILURE);
+        spdlog::error("route {}: load certificate failed", config.name);
+        SSL_CTX_free(ctx);
+        return nullptr;
     }
 
-    if (SSL_CTX_use_PrivateKey_file(ctx, (this->cert_path + "/server.key").c_str(), SSL_FILETYPE_PEM) <= 0)
+    if (SSL_CTX_use_PrivateKey_file(ctx, (config.path + "/server.key").c_str(), SSL_FILETYPE_PEM) <= 0 ||
+        SSL_CTX_check_private_key(ctx) != 1)
+    {
+        spdlog::error("route {}: load private key failed", config.name);
+        SSL_CTX_free(ctx);
+        return nullptr;
+    }
+
+    if (!config.client_ca.empty())
+    {
+        if (SSL_CTX_load_verify_locations(ctx, config.client_ca.c_str(), nullptr) <= 0)
+        {
+            spdlog::error("route {}: load client CA failed", config.name);
+            SSL_CTX_free(ctx);
+            return nullptr;
+        }
+        SSL_CTX_set_client_CA_list(ctx, SSL_load_client_CA_file(config.client_ca.c_str()));
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, nullptr);
+        SSL_CTX_set_cert_verify_callback(ctx, Proxy_server::verify_client_cert, &route);
+
+        // required for session resumption once peers are verified
+        static const unsigned char sid_ctx[] = "proxy_server";
+        SSL_CTX_set_session_id_context(ctx, sid_ctx, sizeof(sid_ctx) - 1);
+    }
+
+    return ctx;
+}
+
+int Proxy_server::verify_client_cert(X509_STORE_CTX *store, void *arg)
+{
+    auto *route = static_cast<Route *>(arg);
+    Proxy_server *server = route->server;
+    X509 *cert = X509_STORE_CTX_get0_cert(store);
+
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len = 0;
+    if (!cert || !X509_digest(cert, EVP_sha256(), md, &md_len))
+        return X509_verify_cert(store);
+
+    std::string fingerprint(reinterpret_cast<char *>(md), md_len);
+    Verify_result cached;
+    int ok;
+
+    if (route->verify_cache.lookup(fingerprint, cached))
+    {
+        server->metrics.verify_cache_hits++;
+        if (!cached.ok)
+            X509_STORE_CTX_set_error(store, cached.error);
+        ok = cached.ok ? 1 : 0;
+    }
+    else
+    {
+        server->metrics.verify_cache_misses++;
+        ok = X509_verify_cert(store) == 1 ? 1 : 0;
+
+        // never trust a cached result past the certificate's own expiry
+        time_t not_after = 0;
+        int days = 0, secs = 0;
+        if (ASN1_TIME_diff(&days, &secs, nullptr, X509_get0_notAfter(cert)))
+            not_after = time(nullptr) + (time_t)days * 86400 + secs;
+
+        route->verify_cache.store(fingerprint, ok == 1, X509_STORE_CTX_get_error(store), not_after);
+    }
+
+    if (ok)
+        server->metrics.client_verify_ok++;
+    else
+        server->metrics.client_verify_failed++;
+    return ok;
+}
+
+SSL_CTX *Proxy_server::create_upstream_context(const Route_config &config)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    if (!ctx)
     {
-        spdlog::error("load private key failed");
+        spdlog::error("upstream SSL_CTX creation failed");
+        ERR_print_errors_fp(stderr);
         exit(EXIT_FAILURE);
     }
+    SSL_CTX_set_mode(ctx, SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_RELEASE_BUFFERS);
+
+    // Sessions are kept in our own per-backend cache, not in the SSL_CTX
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+    SSL_CTX_sess_set_new_cb(ctx, Proxy_server::on_new_upstream_session);
+    SSL_CTX_set_app_data(ctx, this);
+
+    if (!config.upstream_ca.empty())
+    {
+        if (SSL_CTX_load_verify_locations(ctx, config.upstream_ca.c_str(), nullptr) <= 0)
+        {
+            spdlog::error("load upstream CA failed");
+            exit(EXIT_FAILURE);
+        }
+        SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, nullptr);
+    }
 
     return ctx;
 }
 
+int Proxy_server::on_new_upstream_session(SSL *ssl, SSL_SESSION *session)
+{
+    auto *server = static_cast<Proxy_server *>(SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl)));
+    auto *backend = static_cast<const std::string *>(SSL_get_app_data(ssl));
+    if (!server || !backend)
+        return 0;
+
+    // returning 1 hands our reference of the session over to the cache
+    server->upstream_sessions.put(*backend, session);
+    return 1;
+}
+
+/* ================= upstream session cache ================= */
+
+Upstream_session_cache::~Upstream_session_cache()
+{
+    for (auto &[_, session] : sessions_)
+        SSL_SESSION_free(session);
+}
+
+SSL_SESSION *Upstream_session_cache::get(const std::string &backend)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(backend);
+    if (it == sessions_.end())
+        return nullptr;
+
+    if (!SSL_SESSION_is_resumable(it->second))
+    {
+        SSL_SESSION_free(it->second);
+        sessions_.erase(it);
+        return nullptr;
+    }
+    // another worker may replace the entry before the caller is done
+    SSL_SESSION_up_ref(it->second);
+    return it->second;
+}
+
+void Upstream_session_cache::put(const std::string &backend, SSL_SESSION *session)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(backend);
+    if (it != sessions_.end())
+    {
+        SSL_SESSION_free(it->second);
+        it->second = session;
+        return;
+    }
+    sessions_.emplace(backend, session);
+}
+
+void Upstream_session_cache::remove(const std::string &backend)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = sessions_.find(backend);
+    if (it == sessions_.end())
+        return;
+    SSL_SESSION_free(it->second);
+    sessions_.erase(it);
+}
+
+/* ================= client verify cache ================= */
+
+Client_verify_cache::Client_verify_cache()
+    : ttl_(0),
+      capacity_(0)
+{
+}
+
+void Client_verify_cache::configure(int ttl, size_t capacity)
+{
+    ttl_ = ttl;
+    capacity_ = capacity;
+    entries_.clear();
+    order_.clear();
+}
+
+void Client_verify_cache::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    entries_.clear();
+    order_.clear();
+}
+
+bool Client_verify_cache::lookup(const std::string &fingerprint, Verify_result &out)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = entries_.find(fingerprint);
+    if (it == entries_.end())
+        return false;
+
+    if (it->second.result.expires <= time(nullptr))
+    {
+        order_.erase(it->second.order);
+        entries_.erase(it);
+        return false;
+    }
+    out = it->second.result;
+    return true;
+}
+
+void Client_verify_cache::store(const std::string &fingerprint, bool ok, int error, time_t not_after)
+{
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (ttl_ <= 0 || capacity_ == 0)
+        return;
+
+    time_t now = time(nullptr);
+    time_t expires = now + ttl_;
+    if (ok && not_after > 0 && not_after < expires)
+        expires = not_after;
+
+    // a repeat store refreshes the entry and makes it the newest
+    auto it = entries_.find(fingerprint);
+    if (it != entries_.end())
+    {
+        it->second.result = Verify_result{ok, error, expires};
+        order_.splice(order_.end(), order_, it->second.order);
+        return;
+    }
+    if (entries_.size() >= capacity_)
+    {
+        entries_.erase(order_.front());
+        order_.pop_front();
+    }
+    order_.push_back(fingerprint);
+    entries_.emplace(fingerprint, Entry{Verify_result{ok, error, expires}, std::prev(order_.end())});
+}
+
+/* ================= token bucket ================= */
+
+void Token_bucket::configure(double rate, double burst)
+{
+    this->rate = rate;
+    this->burst = burst > 0 ? burst : rate;
+    this->tokens = this->burst;
+    this->last_ns = monotonic_ns();
+}
+
+bool Token_bucket::take(uint64_t now_ns)
+{
+    if (rate <= 0)
+        return true;
+
+    // now_ns is read before the caller's lock: another thread may have
+    // stored a later time already, and the difference must not wrap
+    if (now_ns > last_ns)
+    {
+        tokens += (now_ns - last_ns) * rate / 1e9;
+        if (tokens > burst)
+            tokens = burst;
+        last_ns = now_ns;
+    }
+
+    if (tokens < 1.0)
+        return false;
+    tokens -= 1.0;
+    return true;
+}
+
+// Coarse clock: a vDSO read of the last tick, cheap enough for every accept
+uint64_t monotonic_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Precise clock for latency, still a vDSO read (~20 ns); the coarse one
+// only moves once per tick, too slow for handshake phases
+uint64_t clock_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
 /* ================= public methods ================= */
 
-Proxy_server::Proxy_server(Config config, bool enable_tls)
-    : ep_fd(-1),
-      listen_fd(-1),
-      context(nullptr),
-      enable_tls_(enable_tls),
-      cert_path(std::string(""))
+Proxy_server::Proxy_server(Config config)
+    : ipv6_only_(config.ipv6_only),
+      listener_socket_(config.listener_socket),
+      reload_failed_(false),
+      reload_running_(false),
+      next_worker_(0),
+      ep_fd(-1),
+      timer_fd(-1),
+      stats_fd(-1),
+      signal_fd(-1),
+      reload_fd(-1),
+      accept_mode(config.accept_mode),
+      handshake_stealing(false),
+      numa_local(config.numa_local),
+      incoming_cpu(false),
+      coroutines(config.coroutines),
+      metrics{},
+      trace_sample(0),
+      relay_budget(0),
+      max_connections(0),
+      max_handshakes(0),
+      accept_bucket{},
+      buffer_size(0),
+      zerocopy_threshold(0),
+      draining(false),
+      client_socket(config.client_socket),
+      upstream_socket(config.upstream_socket),
+      tap(config.tap)
 {
-    this->proxy_server_ip = config.server_listen;
-    this->cert_path = config.path;
-    if (enable_tls_)
-        context = create_context();
+    if (config.routes.empty())
+    {
+        spdlog::error("no route configured");
+        exit(EXIT_FAILURE);
+    }
 
-    listen_fd = create_socket();
-    set_nonblocking(listen_fd);
+    this->relay_budget = config.relay_budget > 0 ? config.relay_budget : 0;
+    this->max_connections = config.max_connections > 0 ? config.max_connections : 0;
+    this->max_handshakes = config.max_handshakes > 0 ? config.max_handshakes : 0;
+    this->buffer_size = config.buffer_size > 0 ? config.buffer_size : 65536;
+    this->zerocopy_threshold = config.zerocopy_threshold > 0 ? config.zerocopy_threshold : 0;
+    this->trace_sample = config.trace_sample > 0 ? config.trace_sample : 0;
+    accept_bucket.configure(config.accept_rate, config.accept_burst);
+    ip_limiter.configure(config.ip_rate, config.ip_burst, config.ip_table_size, config.ip_table_shards);
+
+    std::string acl_error;
+    acl = Cidr_acl::build(config.allow, config.deny, acl_error);
+    if (!acl)
+    {
+        spdlog::error("allow/deny list: {}", acl_error);
+        exit(EXIT_FAILURE);
+    }
+
+    // Block before any thread exists so SIGHUP is only seen through signal_fd;
+    // workers and crypto threads inherit the mask
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+    signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+
+    bool any_tls = false;
+    for (const Route_config &route_config : config.routes)
+    {
+        auto route = std::make_unique<Route>();
+        route->config = route_config;
+        route->server = this;
+        route->context = nullptr;
+        route->upstream_context = nullptr;
+        route->upstream_key = route_config.proxy_host + ":" + std::to_string(route_config.proxy_pass);
+        // a resumed session skips verification: never across routes that verify differently
+        route->session_key = route->upstream_key + " " + route_config.upstream_ca + " " + route_config.upstream_sni;
+        resolve_upstream(*route);
+        route->verify_cache.configure(config.verify_cache_ttl, config.verify_cache_size);
+
+        if (route_config.mode == MODE_TLS)
+        {
+            route->context = create_context(*route);
+            if (!route->context)
+                exit(EXIT_FAILURE);
+            any_tls = true;
+        }
+        if (route_config.upstream_tls)
+            route->upstream_context = create_upstream_context(route_config);
+
+        spdlog::info("route {}: {} -> {}{}", route_config.name,
+                     route_config.mode == MODE_TLS ? "tls" : "plain",
+                     route->upstream_key, route_config.upstream_tls ? " (tls)" : "");
+        routes.push_back(std::move(route));
+    }
 
     ep_fd = epoll_create1(0);
     if (ep_fd < 0)
@@ -96,11 +605,404 @@ Proxy_server::Proxy_server(Config config, bool enable_tls)
         exit(EXIT_FAILURE);
     }
 
-    if (add_epoll_event(listen_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    // a connection task runs SSL_accept in line, between its other steps
+    if (coroutines && config.crypto_threads > 0)
+        spdlog::warn("crypto_threads do not apply to coroutines, ignored");
+    else if (any_tls && config.crypto_threads > 0)
     {
-        spdlog::error("add epoll event failed");
+        crypto_pool = std::make_unique<Crypto_pool>(config.crypto_threads);
+        spdlog::info("TLS handshakes offloaded to {} crypto threads", config.crypto_threads);
+    }
+
+    // a CPU outside the process' affinity mask would fail on the worker thread
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    sched_getaffinity(0, sizeof(allowed), &allowed);
+    for (int cpu : config.worker_cpus)
+    {
+        if (!CPU_ISSET(cpu, &allowed))
+        {
+            spdlog::error("worker_cpus: cpu {} is not available to this process", cpu);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    int worker_count = config.workers > 0 ? config.workers : 1;
+    for (int i = 0; i < worker_count; ++i)
+    {
+        int cpu = config.worker_cpus.empty() ? -1 : config.worker_cpus[i % config.worker_cpus.size()];
+        int busy_poll_us = config.busy_poll_us.empty() ? 0 : config.busy_poll_us[i % config.busy_poll_us.size()];
+        workers.push_back(std::make_unique<Worker>(this, i, cpu, busy_poll_us));
+    }
+    if (!config.worker_cpus.empty())
+        spdlog::info("workers pinned to cpus {}", fmt::join(config.worker_cpus, ","));
+    if (!config.busy_poll_us.empty())
+        spdlog::info("worker busy poll (us) {}", fmt::join(config.busy_poll_us, ","));
+
+    incoming_cpu = config.incoming_cpu && !config.worker_cpus.empty();
+    if (config.incoming_cpu && !incoming_cpu)
+        spdlog::warn("incoming_cpu needs worker_cpus, ignored");
+
+    // every route, address family and port is served by every worker: each
+    // gets its own socket in reuseport mode, the main thread accepts for all
+    // of them otherwise
+    for (auto &route : routes)
+    {
+        for (const std::string &address : route->config.listen)
+        {
+            if (accept_mode == ACCEPT_ACCEPTOR)
+            {
+                int fd = create_socket(address, false);
+                set_nonblocking(fd);
+                if (add_epoll_event(fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+                {
+                    spdlog::error("add epoll event failed");
+                    exit(EXIT_FAILURE);
+                }
+                listen_fds.push_back(fd);
+                listeners.emplace_back(fd, route.get());
+                continue;
+            }
+            for (auto &worker : workers)
+            {
+                int fd = create_socket(address, worker_count > 1);
+                set_nonblocking(fd);
+                // reuseport then prefers the socket whose worker runs on the receiving CPU
+                if (incoming_cpu && setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &worker->cpu, sizeof(worker->cpu)) < 0)
+                    spdlog::warn("SO_INCOMING_CPU problem... ({})", address);
+                if (worker->add_epoll_event(fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+                {
+                    spdlog::error("add epoll event failed");
+                    exit(EXIT_FAILURE);
+                }
+                worker->listeners.emplace_back(fd, route.get());
+            }
+        }
+    }
+    spdlog::info("{} workers, {} accept", worker_count, accept_mode == ACCEPT_ACCEPTOR ? "acceptor thread" : "SO_REUSEPORT");
+
+    // with a crypto pool no worker runs SSL_accept itself, nothing to steal
+    handshake_stealing = config.handshake_stealing && worker_count > 1 && !crypto_pool && !coroutines;
+    if (config.handshake_stealing && !handshake_stealing)
+        spdlog::warn("handshake_stealing needs workers > 1, no crypto_threads and no coroutines, ignored");
+    if (coroutines)
+        spdlog::info("connections run as coroutines");
+
+    if (signal_fd < 0 || add_epoll_event(signal_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    {
+        spdlog::error("signalfd setup failed");
         exit(EXIT_FAILURE);
     }
+
+    reload_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (reload_fd < 0 || add_epoll_event(reload_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    {
+        spdlog::error("reload eventfd setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!config.admin_socket.empty())
+        admin = std::make_unique<Admin_socket>(this, config.admin_socket);
+
+    if (config.metrics_interval > 0)
+    {
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        itimerspec its{};
+        its.it_value.tv_sec = config.metrics_interval;
+        its.it_interval.tv_sec = config.metrics_interval;
+        if (timer_fd < 0 ||
+            timerfd_settime(timer_fd, 0, &its, nullptr) < 0 ||
+            add_epoll_event(timer_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+        {
+            spdlog::error("metrics timer setup failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (!config.stats_path.empty())
+    {
+        stats = std::make_unique<Stats_segment>(config.stats_path, worker_count, config.stats_interval_ms);
+        stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        itimerspec its{};
+        its.it_value.tv_nsec = 1;
+        its.it_interval.tv_sec = config.stats_interval_ms / 1000;
+        its.it_interval.tv_nsec = config.stats_interval_ms % 1000 * 1000000l;
+        if (stats_fd < 0 ||
+            timerfd_settime(stats_fd, 0, &its, nullptr) < 0 ||
+            add_epoll_event(stats_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+        {
+            spdlog::error("stats timer setup failed");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+Proxy_server::~Proxy_server()
+{
+    if (reload_thread_.joinable())
+        reload_thread_.join();
+    for (auto &[fd, pending] : sniffing)
+        close(fd);
+}
+
+// Once the constructor is done: workers read everything set up there
+void Proxy_server::start_workers()
+{
+    for (auto &worker : workers)
+        worker->start();
+}
+
+/**
+ * The worker with the fewest connections, counting the ones still on
+ * their way to it. Ties go round-robin so an idle pool fills evenly.
+ */
+Worker *Proxy_server::least_loaded_worker()
+{
+    size_t n = workers.size();
+    Worker *best = nullptr;
+    size_t best_load = 0;
+    for (size_t i = 0; i < n; ++i)
+    {
+        Worker *worker = workers[(next_worker_ + i) % n].get();
+        size_t load = worker->load.load(std::memory_order_relaxed);
+        if (!best || load < best_load)
+        {
+            best = worker;
+            best_load = load;
+        }
+    }
+    next_worker_++;
+    return best;
+}
+
+// nullptr when no worker is pinned to cpu; the least loaded of several
+Worker *Proxy_server::worker_on_cpu(int cpu)
+{
+    Worker *best = nullptr;
+    for (auto &worker : workers)
+    {
+        if (worker->cpu == cpu && (!best || worker->load < best->load))
+            best = worker.get();
+    }
+    return best;
+}
+
+size_t Proxy_server::connection_count() const
+{
+    size_t total = 0;
+    for (const auto &worker : workers)
+        total += worker->load.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t Proxy_server::handshake_count() const
+{
+    size_t total = 0;
+    for (const auto &worker : workers)
+        total += worker->handshakes.load(std::memory_order_relaxed);
+    return total;
+}
+
+void Proxy_server::report_metrics()
+{
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        spdlog::error("metrics timer read failed");
+
+    Latency_metrics latency;
+    size_t pool_blocks = 0;
+    uint64_t relay_reads = 0, relay_writes = 0;
+    for (auto &worker : workers)
+    {
+        std::lock_guard<std::mutex> lock(worker->mutex);
+        latency.merge(worker->latency);
+        pool_blocks += worker->buffer_pool.allocated();
+        relay_reads += worker->totals.relay_reads;
+        relay_writes += worker->totals.relay_writes;
+    }
+
+    uint64_t lookups = metrics.verify_cache_hits + metrics.verify_cache_misses;
+    spdlog::info("metrics: client_verify ok={} failed={}, verify_cache hits={} misses={} hit_rate={:.1f}%, offloaded_handshakes={}, stolen_handshakes={}, "
+                 "shed acl={} connection_limit={} handshake_limit={} accept_rate={} ip_rate={}, ip_table_evictions={}, "
+                 "relay reads={} writes={}, zerocopy sends={} copied_sockets={} pool_blocks={}",
+                 metrics.client_verify_ok.load(),
+                 metrics.client_verify_failed.load(),
+                 metrics.verify_cache_hits.load(),
+                 metrics.verify_cache_misses.load(),
+                 lookups ? 100.0 * metrics.verify_cache_hits / lookups : 0.0,
+                 metrics.offloaded_handshakes.load(),
+                 metrics.stolen_handshakes.load(),
+                 metrics.shed_acl.load(),
+                 metrics.shed_connection_limit.load(),
+                 metrics.shed_handshake_limit.load(),
+                 metrics.shed_accept_rate.load(),
+                 metrics.shed_ip_rate.load(),
+                 ip_limiter.evictions.load(),
+                 relay_reads,
+                 relay_writes,
+                 metrics.zerocopy_sends.load(),
+                 metrics.zerocopy_copied.load(),
+                 pool_blocks);
+
+    const std::pair<const char *, const Latency_histogram *> phases[] = {
+        {"handshake", &latency.handshake},
+        {"upstream", &latency.upstream},
+        {"first_byte", &latency.first_byte},
+        {"lifetime", &latency.lifetime},
+        {"loop", &latency.loop}};
+    std::string line;
+    for (auto &[name, h] : phases)
+        line += fmt::format(" {} n={} p50={} p99={} p999={}", name, h->count(), h->percentile(50), h->percentile(99), h->percentile(99.9));
+    spdlog::info("latency_us:{}", line);
+}
+
+/**
+ * Write the server block of the stats segment. Everything here is an
+ * atomic already, or summed from the worker blocks through their seqlock;
+ * the workers are not locked or woken.
+ */
+void Proxy_server::publish_stats()
+{
+    uint64_t expirations;
+    if (read(stats_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        spdlog::error("stats timer read failed");
+
+    uint64_t relay_reads = 0, relay_writes = 0;
+    for (size_t id = 0; id < workers.size(); ++id)
+    {
+        Stats_worker worker;
+        if (stats_read(&worker, stats->worker(id), sizeof(worker)))
+        {
+            relay_reads += worker.relay_reads;
+            relay_writes += worker.relay_writes;
+        }
+    }
+
+    Stats_server *block = stats->server();
+    stats_write_begin(&block->seq);
+    block->updated_ns = clock_ns();
+    block->connections = connection_count();
+    block->pending_handshakes = handshake_count();
+    block->max_connections = max_connections.load();
+    block->max_handshakes = max_handshakes.load();
+    block->draining = draining.load();
+    block->client_verify_ok = metrics.client_verify_ok.load();
+    block->client_verify_failed = metrics.client_verify_failed.load();
+    block->verify_cache_hits = metrics.verify_cache_hits.load();
+    block->verify_cache_misses = metrics.verify_cache_misses.load();
+    block->offloaded_handshakes = metrics.offloaded_handshakes.load();
+    block->stolen_handshakes = metrics.stolen_handshakes.load();
+    block->shed_acl = metrics.shed_acl.load();
+    block->shed_connection_limit = metrics.shed_connection_limit.load();
+    block->shed_handshake_limit = metrics.shed_handshake_limit.load();
+    block->shed_accept_rate = metrics.shed_accept_rate.load();
+    block->shed_ip_rate = metrics.shed_ip_rate.load();
+    block->relay_reads = relay_reads;
+    block->relay_writes = relay_writes;
+    block->zerocopy_sends = metrics.zerocopy_sends.load();
+    block->zerocopy_copied = metrics.zerocopy_copied.load();
+    stats_write_end(&block->seq);
+}
+
+/**
+ * SIGHUP or admin "reload": re-read config.json for the allow/deny list,
+ * and the certificate, key and client CA of every TLS route. Parsing, the
+ * ACL build and key checks all run on a helper thread, the main thread
+ * keeps accepting meanwhile. The ACL is swapped in from there;
+ * install_contexts() swaps the SSL_CTXs in on the loop once reload_fd fires.
+ */
+void Proxy_server::reload()
+{
+    if (reload_running_)
+    {
+        spdlog::info("reload: already running");
+        return;
+    }
+    if (reload_thread_.joinable())
+        reload_thread_.join();
+    reload_running_ = true;
+
+    reload_thread_ = std::thread([this]
+                                 {
+                                     reload_config(this);
+                                     build_contexts();
+                                 });
+}
+
+// Runs on reload_thread_; routes and their configs are never changed after startup
+void Proxy_server::build_contexts()
+{
+    std::vector<Context_reload> built;
+    bool failed = false;
+    for (auto &route : routes)
+    {
+        if (route->config.mode != MODE_TLS)
+            continue;
+        SSL_CTX *ctx = create_context(*route);
+        if (!ctx)
+        {
+            failed = true;
+            break;
+        }
+        built.push_back(Context_reload{route.get(), ctx});
+    }
+    {
+        std::lock_guard<std::mutex> lock(reload_mutex_);
+        reloaded_ = std::move(built);
+        reload_failed_ = failed;
+    }
+    uint64_t one = 1;
+    if (write(reload_fd, &one, sizeof(one)) < 0)
+        spdlog::error("reload eventfd write failed");
+}
+
+/**
+ * All routes switch or none does. Handshakes already running keep the
+ * SSL_CTX they were created with: every SSL holds its own reference.
+ */
+void Proxy_server::install_contexts()
+{
+    uint64_t count;
+    if (read(reload_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        spdlog::error("reload eventfd read failed");
+
+    std::vector<Context_reload> built;
+    bool failed;
+    {
+        std::lock_guard<std::mutex> lock(reload_mutex_);
+        built.swap(reloaded_);
+        failed = reload_failed_;
+    }
+    reload_thread_.join();
+    reload_running_ = false;
+
+    if (failed)
+    {
+        for (Context_reload &r : built)
+            SSL_CTX_free(r.context);
+        spdlog::error("reload: certificates rejected, keeping the running ones");
+        return;
+    }
+    std::lock_guard<std::mutex> lock(context_mutex_);
+    for (Context_reload &r : built)
+    {
+        SSL_CTX_free(r.route->context);
+        r.route->context = r.context;
+        // a new client CA must not be answered from old verdicts
+        r.route->verify_cache.clear();
+        spdlog::info("reload: route {} certificates reloaded", r.route->config.name);
+    }
+}
+
+// nullptr when fd is not a listen socket
+Route *Proxy_server::listener_route(int fd) const
+{
+    for (const auto &[l, route] : listeners)
+    {
+        if (l == fd)
+            return route;
+    }
+    return nullptr;
 }
 
 int Proxy_server::add_epoll_event(int fd, int op, uint32_t events)
@@ -155,102 +1057,110 @@ int Proxy_server::align_between_connection(int client_fd, ProxyMode mode)
 
     return 0;
 }
-int Proxy_server::handle_server_side(SSL *ssl, int client_fd, int server_fd)
+
+// The route's current server SSL_CTX; the SSL keeps its own reference
+SSL *Proxy_server::create_client_ssl(int client_fd, Route &route)
+{
+    SSL *ssl;
+    {
+        std::lock_guard<std::mutex> lock(context_mutex_);
+        ssl = SSL_new(route.context);
+    }
+    if (ssl)
+        SSL_set_fd(ssl, client_fd);
+    return ssl;
+}
+
+/**
+ * The name the upstream certificate must carry: upstream_sni, else
+ * proxy_host, checked as an IP address SAN when it is a literal.
+ * return false when OpenSSL refused it
+ */
+static bool set_upstream_name(SSL *ssl, const Route_config &config)
+{
+    const std::string &name = config.upstream_sni.empty() ? config.proxy_host : config.upstream_sni;
+    unsigned char address[sizeof(in6_addr)];
+    if (inet_pton(AF_INET, name.c_str(), address) == 1 || inet_pton(AF_INET6, name.c_str(), address) == 1)
+        return X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), name.c_str()) == 1;
+    return SSL_set1_host(ssl, name.c_str()) == 1;
+}
+
+SSL *Proxy_server::create_upstream_ssl(int server_fd, Route &route)
 {
-    char buffer[4096];
+    const Route_config &config = route.config;
+    SSL *ssl = SSL_new(route.upstream_context);
+    if (!ssl)
+        return nullptr;
+
+    SSL_set_fd(ssl, server_fd);
+    SSL_set_connect_state(ssl);
+    SSL_set_app_data(ssl, &route.session_key);
 
-    while (true)
+    if (!config.upstream_sni.empty())
+        SSL_set_tlsext_host_name(ssl, config.upstream_sni.c_str());
+    // the CA vouches for every certificate it signed: the name has to match too
+    if (!config.upstream_ca.empty() && !set_upstream_name(ssl, config))
     {
-        int bytes = recv(server_fd, buffer, sizeof(buffer), 0);
+        spdlog::error("route {}: can't set the upstream name to verify", config.name);
+        SSL_free(ssl);
+        return nullptr;
+    }
 
-        if (bytes > 0)
-        {
-            int sent = 0;
-            while (sent < bytes)
-            {
-                int n;
-                if (enable_tls_)
-                {
-                    n = SSL_write(ssl, buffer + sent, bytes - sent);
-                    if (n <= 0)
-                    {
-                        int err = SSL_get_error(ssl, n);
-                        if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                            return 1;
-                        return -1;
-                    }
-                }
-                else
-                {
-                    n = send(client_fd, buffer + sent, bytes - sent, 0);
-                    if (n < 0)
-                    {
-                        if (errno == EAGAIN || errno == EWOULDBLOCK)
-                            return 1;
-                        return -1;
-                    }
-                }
-                sent += n;
-            }
-        }
-        else if (bytes == 0)
-        {
-            return 0;
-        }
-        else
-        {
-            if (errno == EAGAIN || errno == EWOULDBLOCK)
-            {
-                return 1;
-            }
-            return -1;
-        }
+    SSL_SESSION *session = upstream_sessions.get(route.session_key);
+    if (session)
+    {
+        SSL_set_session(ssl, session);
+        SSL_SESSION_free(session);
     }
+
+    return ssl;
 }
 
-int Proxy_server::handle_client_side(SSL *ssl, int client_fd, int server_fd)
+/**
+ * return:
+ *   0   -> handshake finished
+ *   1   -> handshake in progress, wait for the next event
+ *  -1   -> handshake failed
+ */
+int Proxy_server::upstream_handshake(SSL *upstream_ssl)
 {
-    char buffer[4096];
-
-    while (true)
+    int ret = SSL_do_handshake(upstream_ssl);
+    if (ret == 1)
     {
-        int bytes;
+        spdlog::info("Upstream TLS handshake success ({})",
+                     SSL_session_reused(upstream_ssl) ? "resumed" : "full");
+        return 0;
+    }
 
-        if (enable_tls_)
-        {
-            bytes = SSL_read(ssl, buffer, sizeof(buffer));
-            if (bytes <= 0)
-            {
-                int err = SSL_get_error(ssl, bytes);
-                if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
-                    return 1;
-                return -1;
-            }
-        }
-        else
-        {
-            bytes = recv(client_fd, buffer, sizeof(buffer), 0);
-            if (bytes <= 0)
-            {
-                if (bytes == 0)
-                    return 0;
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    return 1;
-                return -1;
-            }
-        }
+    int err = SSL_get_error(upstream_ssl, ret);
+    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+        return 1;
 
-        int sent = 0;
-        while (sent < bytes)
-        {
-            int n = send(server_fd, buffer + sent, bytes - sent, 0);
-            if (n < 0)
-            {
-                if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    return 1;
-                return -1;
-            }
-            sent += n;
-        }
+    // never offer a session the backend just refused again
+    auto *backend = static_cast<const std::string *>(SSL_get_app_data(upstream_ssl));
+    if (backend)
+        upstream_sessions.remove(*backend);
+    ERR_print_errors_fp(stderr);
+    return -1;
+}
+
+/**
+ * Stop accepting; every worker closes its own listeners when woken and
+ * stops once its last connection is gone, then the main loop exits.
+ */
+void Proxy_server::drain()
+{
+    if (draining)
+        return;
+    draining = true;
+    for (int fd : listen_fds)
+    {
+        epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
     }
+    listen_fds.clear();
+    listeners.clear();
+    for (auto &worker : workers)
+        worker->wake();
+    spdlog::info("draining: listeners closed");
 }
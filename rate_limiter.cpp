@@ -0,0 +1,149 @@
+#include "./type.hpp"
+
+#include <string.h>
+#include <sys/random.h>
+
+#include <algorithm>
+
+/* ================= private helpers ================= */
+
+namespace
+{
+    // IPv4 is folded into the v4-mapped IPv6 range so both share one key space
+    bool address_key(const sockaddr *addr, uint64_t &hi, uint64_t &lo)
+    {
+        unsigned char bytes[16] = {};
+        if (addr->sa_family == AF_INET)
+        {
+            auto *in = reinterpret_cast<const sockaddr_in *>(addr);
+            bytes[10] = 0xff;
+            bytes[11] = 0xff;
+            memcpy(bytes + 12, &in->sin_addr, 4);
+        }
+        else if (addr->sa_family == AF_INET6)
+        {
+            auto *in6 = reinterpret_cast<const sockaddr_in6 *>(addr);
+            memcpy(bytes, &in6->sin6_addr, 16);
+        }
+        else
+        {
+            return false;
+        }
+        memcpy(&hi, bytes, 8);
+        memcpy(&lo, bytes + 8, 8);
+        return true;
+    }
+
+    uint64_t mix(uint64_t hi, uint64_t lo, uint64_t seed)
+    {
+        uint64_t h = (hi ^ seed) * 0x9e3779b97f4a7c15ull;
+        h ^= (lo + (h >> 29)) * 0xbf58476d1ce4e5b9ull;
+        h ^= h >> 32;
+        h *= 0x94d049bb133111ebull;
+        return h ^ (h >> 31);
+    }
+
+    size_t round_up_pow2(size_t n)
+    {
+        size_t p = 1;
+        while (p < n)
+            p <<= 1;
+        return p;
+    }
+}
+
+/* ================= public methods ================= */
+
+Ip_rate_limiter::Ip_rate_limiter()
+    : shard_count_(0),
+      slot_mask_(0),
+      rate_(0),
+      burst_(0),
+      seed_(0),
+      evictions(0)
+{
+}
+
+void Ip_rate_limiter::configure(double rate, double burst, size_t capacity, size_t shard_count)
+{
+    rate_ = rate;
+    burst_ = burst > 0 ? burst : rate;
+    if (rate_ <= 0)
+        return;
+
+    shard_count = round_up_pow2(shard_count > 0 ? shard_count : 1);
+    size_t per_shard = round_up_pow2(capacity / shard_count);
+    if (per_shard < probe_window)
+        per_shard = probe_window;
+
+    // random seed: spoofed floods must not be able to aim at one probe window
+    if (getrandom(&seed_, sizeof(seed_), 0) != sizeof(seed_))
+        seed_ = monotonic_ns();
+
+    shard_count_ = shard_count;
+    slot_mask_ = per_shard - 1;
+    shards_.reset(new Shard[shard_count]);
+    for (size_t i = 0; i < shard_count; ++i)
+        shards_[i].slots.assign(per_shard, Slot{});
+}
+
+/**
+ * Take one token from the bucket of addr's source address.
+ * return false when that address is over its rate.
+ */
+bool Ip_rate_limiter::allow(const sockaddr *addr, uint64_t now_ns)
+{
+    if (rate_ <= 0)
+        return true;
+
+    uint64_t hi, lo;
+    if (!address_key(addr, hi, lo))
+        return true;
+
+    uint64_t h = mix(hi, lo, seed_);
+    Shard &shard = shards_[(h >> 48) & (shard_count_ - 1)];
+    size_t base = h & slot_mask_;
+
+    // a bucket idle this long has refilled completely and is as good as new
+    uint64_t refill_ns = (uint64_t)(burst_ / rate_ * 1e9);
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+
+    Slot *victim = nullptr;
+    Slot *slot = nullptr;
+    for (size_t i = 0; i < probe_window; ++i)
+    {
+        Slot &s = shard.slots[(base + i) & slot_mask_];
+        if (s.last_ns != 0 && s.hi == hi && s.lo == lo)
+        {
+            slot = &s;
+            break;
+        }
+        if (!victim || s.last_ns < victim->last_ns)
+            victim = &s;
+    }
+
+    if (!slot)
+    {
+        if (victim->last_ns != 0 && (now_ns <= victim->last_ns || now_ns - victim->last_ns < refill_ns))
+            evictions++;
+        slot = victim;
+        slot->hi = hi;
+        slot->lo = lo;
+        slot->tokens = burst_;
+    }
+    else if (now_ns > slot->last_ns)
+    {
+        // an accept on another worker may have stored a later now_ns
+        // already; only a later time refills, the difference must not wrap
+        double tokens = slot->tokens + (now_ns - slot->last_ns) * rate_ / 1e9;
+        slot->tokens = tokens > burst_ ? burst_ : tokens;
+    }
+    // never 0, which marks an empty slot
+    slot->last_ns = std::max<uint64_t>(slot->last_ns, now_ns ? now_ns : 1);
+
+    if (slot->tokens < 1.0)
+        return false;
+    slot->tokens -= 1.0;
+    return true;
+}
@@ -0,0 +1,80 @@
+#include "./type.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <spdlog/spdlog.h>
+
+static const uint32_t STATS_HEADER_SIZE = 64;
+static_assert(sizeof(Stats_header) <= STATS_HEADER_SIZE, "Stats_header outgrew its room");
+
+static uint64_t realtime_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Replace the file at path with a fresh segment. Unlinked first, not
+ * truncated: a reader still mapping the old one keeps its pages instead
+ * of a SIGBUS, and sees the old pid gone.
+ */
+Stats_segment::Stats_segment(const std::string &path, int worker_count, int interval_ms)
+    : fd_(-1),
+      size_(0),
+      header_(nullptr)
+{
+    uint32_t server_offset = STATS_HEADER_SIZE;
+    uint32_t worker_offset = (server_offset + sizeof(Stats_server) + 63) & ~63u;
+    size_ = worker_offset + worker_count * sizeof(Stats_worker);
+
+    unlink(path.c_str());
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd_ < 0 || ftruncate(fd_, size_) < 0)
+    {
+        spdlog::error("stats file {}: {}", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    void *map = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, 0);
+    if (map == MAP_FAILED)
+    {
+        spdlog::error("stats file {}: mmap failed: {}", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    header_ = static_cast<Stats_header *>(map);
+
+    header_->version = STATS_VERSION;
+    header_->header_size = STATS_HEADER_SIZE;
+    header_->pid = getpid();
+    header_->started_ns = realtime_ns();
+    header_->server_offset = server_offset;
+    header_->server_size = sizeof(Stats_server);
+    header_->worker_offset = worker_offset;
+    header_->worker_size = sizeof(Stats_worker);
+    header_->worker_count = worker_count;
+    header_->interval_ms = interval_ms;
+    // last: a reader takes the file for a segment once the magic is there
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header_->magic, STATS_MAGIC, sizeof(STATS_MAGIC));
+    spdlog::info("stats segment {} ({} bytes)", path, size_);
+}
+
+Stats_segment::~Stats_segment()
+{
+    munmap(header_, size_);
+    ::close(fd_);
+}
+
+Stats_server *Stats_segment::server()
+{
+    return reinterpret_cast<Stats_server *>(reinterpret_cast<char *>(header_) + header_->server_offset);
+}
+
+Stats_worker *Stats_segment::worker(int id)
+{
+    return reinterpret_cast<Stats_worker *>(reinterpret_cast<char *>(header_) + header_->worker_offset) + id;
+}
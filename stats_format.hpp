@@ -0,0 +1,128 @@
+#pragma once
+
+/**
+ * Layout of the stats segment, config.json "stats_path": one file, mapped
+ * shared, that the proxy keeps current and any number of readers map
+ * read-only. Reading it takes no syscall and no lock the workers see.
+ * Shared with tools/proxy_top.cpp.
+ *
+ * A Stats_header, then a Stats_server block at server_offset, then
+ * worker_count Stats_worker blocks from worker_offset, worker_size bytes
+ * apart. Each block has one writer: the main thread for Stats_server,
+ * every stats_interval_ms; a worker for its own block, after each batch of
+ * events, so an idle worker's updated_ns stays where it was.
+ *
+ * Versioning: fields are only added at the end of a block, the sizes in
+ * the header grow with them. A reader takes offsets and sizes from the
+ * header, not from sizeof, and copies min(its size, the header's); fields
+ * it does not know are ignored, fields the proxy does not write read 0.
+ * version changes only when an existing field moves or changes meaning.
+ *
+ * Every block starts with a seqlock: seq is odd while its writer is in the
+ * block. stats_read() copies a block until seq was even and the same before
+ * and after. The proxy unlinks and recreates the file at startup, a reader
+ * that sees pid gone or the path on another inode maps it again. Counters
+ * only grow, gauges hold at updated_ns. Native byte order.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+static const char STATS_MAGIC[8] = {'P', 'X', 'Y', 'S', 'T', 'A', 'T', '1'};
+static const uint32_t STATS_VERSION = 1;
+
+struct Stats_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    uint64_t pid;
+    uint64_t started_ns; // CLOCK_REALTIME
+    uint32_t server_offset;
+    uint32_t server_size;
+    uint32_t worker_offset;
+    uint32_t worker_size; // stride, a multiple of 64
+    uint32_t worker_count;
+    uint32_t interval_ms; // Stats_server refresh
+};
+
+// Proxy wide; updated_ns and all times are CLOCK_MONOTONIC
+struct Stats_server
+{
+    uint64_t seq;
+    uint64_t updated_ns;
+    uint64_t connections;        // owned or being handed to a worker
+    uint64_t pending_handshakes; // TLS clients not through SSL_accept
+    uint64_t max_connections;    // 0 = no limit
+    uint64_t max_handshakes;
+    uint64_t draining;
+    uint64_t client_verify_ok;
+    uint64_t client_verify_failed;
+    uint64_t verify_cache_hits;
+    uint64_t verify_cache_misses;
+    uint64_t offloaded_handshakes;
+    uint64_t stolen_handshakes;
+    uint64_t shed_acl;
+    uint64_t shed_connection_limit;
+    uint64_t shed_handshake_limit;
+    uint64_t shed_accept_rate;
+    uint64_t shed_ip_rate;
+    uint64_t relay_reads;  // sum of the worker blocks
+    uint64_t relay_writes;
+    uint64_t zerocopy_sends;
+    uint64_t zerocopy_copied;
+};
+
+// One worker; on its own cache lines, it is written after every batch
+struct alignas(64) Stats_worker
+{
+    uint64_t seq;
+    uint64_t updated_ns;
+    int64_t cpu; // pinned to, -1 = not pinned
+    uint64_t connections;
+    uint64_t load; // connections plus handoffs on the way
+    uint64_t pending_handshakes;
+    uint64_t queued_handshakes; // waiting for this worker or a thief
+    uint64_t ready;             // connections that used up relay_budget
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t handshakes; // client TLS handshakes done
+    uint64_t bytes_in;   // client -> upstream
+    uint64_t bytes_out;  // upstream -> client
+    uint64_t batches;    // epoll batches handled
+    uint64_t pool_blocks;
+    uint64_t relay_reads;
+    uint64_t relay_writes;
+};
+
+// Writer: stats_write_begin(&block->seq), fill in the block, stats_write_end(&block->seq)
+static inline void stats_write_begin(uint64_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void stats_write_end(uint64_t *seq)
+{
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copy size bytes of a block that starts with its seq.
+ * return false when the writer was in the block on every try
+ */
+static inline bool stats_read(void *dst, const void *block, size_t size)
+{
+    const uint64_t *seq = static_cast<const uint64_t *>(block);
+    for (int tries = 0; tries < 1000; ++tries)
+    {
+        uint64_t before = __atomic_load_n(seq, __ATOMIC_ACQUIRE);
+        if (before & 1)
+            continue;
+        memcpy(dst, block, size);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(seq, __ATOMIC_RELAXED) == before)
+            return true;
+    }
+    return false;
+}
@@ -0,0 +1,148 @@
+#include "./type.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+
+#include <spdlog/spdlog.h>
+
+// Records start on their own page
+static const uint32_t TAP_HEADER_SIZE = 4096;
+
+static uint64_t realtime_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * Create or truncate the ring file and map it. MAP_POPULATE faults every
+ * page in now, so the relay never waits on a page fault into it; a path
+ * on tmpfs (/dev/shm) also keeps writeback off the disk.
+ */
+Tap_ring::Tap_ring(const std::string &path, int worker, size_t capacity, size_t snaplen)
+    : fd_(-1),
+      header_(nullptr),
+      data_(nullptr),
+      capacity_(capacity & ~(uint64_t)7),
+      worker_(worker),
+      snaplen_(snaplen),
+      next_id_(0),
+      next_pos_(0)
+{
+    fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd_ < 0 || ftruncate(fd_, TAP_HEADER_SIZE + capacity_) < 0)
+    {
+        spdlog::error("tap file {}: {}", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    void *map = mmap(nullptr, TAP_HEADER_SIZE + capacity_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, 0);
+    if (map == MAP_FAILED)
+    {
+        spdlog::error("tap file {}: mmap failed: {}", path, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    header_ = static_cast<Tap_header *>(map);
+    data_ = static_cast<char *>(map) + TAP_HEADER_SIZE;
+
+    header_->version = TAP_VERSION;
+    header_->header_size = TAP_HEADER_SIZE;
+    header_->capacity = capacity_;
+    header_->worker = worker;
+    header_->snaplen = snaplen;
+    // last: a reader takes the file for a ring once the magic is there
+    memcpy(header_->magic, TAP_MAGIC, sizeof(TAP_MAGIC));
+    spdlog::info("worker {}: tap ring {} ({} bytes)", worker, path, capacity_);
+}
+
+Tap_ring::~Tap_ring()
+{
+    munmap(header_, TAP_HEADER_SIZE + capacity_);
+    ::close(fd_);
+}
+
+/**
+ * Room for a record with length bytes of payload, header filled in.
+ * A record does not wrap: the end of the ring is padded when too short.
+ * return nullptr when the reader has not freed enough space.
+ */
+Tap_record *Tap_ring::append(uint16_t type, uint64_t conn_id, uint32_t length)
+{
+    uint32_t size = (sizeof(Tap_record) + length + 7) & ~7u;
+    uint64_t pos = header_->write_pos;
+    uint64_t read = __atomic_load_n(&header_->read_pos, __ATOMIC_ACQUIRE);
+    uint64_t room = capacity_ - pos % capacity_;
+    uint64_t need = size <= room ? size : room + size;
+    if (size > capacity_ || pos + need - read > capacity_)
+    {
+        header_->dropped++;
+        header_->dropped_bytes += length;
+        return nullptr;
+    }
+
+    if (size > room)
+    {
+        auto *pad = reinterpret_cast<Tap_record *>(data_ + pos % capacity_);
+        pad->size = room;
+        pad->type = TAP_PAD;
+        pos += room;
+    }
+    auto *record = reinterpret_cast<Tap_record *>(data_ + pos % capacity_);
+    record->size = size;
+    record->type = type;
+    record->direction = 0;
+    record->conn_id = conn_id;
+    record->timestamp_ns = realtime_ns();
+    record->length = length;
+    record->orig_length = length;
+    next_pos_ = pos + size;
+    return record;
+}
+
+// Publish the record append() handed out
+void Tap_ring::commit()
+{
+    header_->records++;
+    __atomic_store_n(&header_->write_pos, next_pos_, __ATOMIC_RELEASE);
+}
+
+// Start tapping a connection; the id stays valid even if this record dropped
+uint64_t Tap_ring::open(const Connection_meta &meta)
+{
+    uint64_t conn_id = (uint64_t)worker_ << 48 | ++next_id_;
+    Tap_record *record = append(TAP_OPEN, conn_id, sizeof(Tap_open));
+    if (!record)
+        return conn_id;
+
+    Tap_open *open = reinterpret_cast<Tap_open *>(record + 1);
+    memset(open, 0, sizeof(*open));
+    memcpy(open->client, &meta.peer, std::min(sizeof(meta.peer), sizeof(open->client)));
+    memcpy(open->upstream, &meta.route->upstream_addr, std::min<size_t>(meta.route->upstream_addr_len, sizeof(open->upstream)));
+    strncpy(open->route, meta.route->config.name.c_str(), sizeof(open->route) - 1);
+    commit();
+    return conn_id;
+}
+
+// len bytes read from one side, as they go to the other; snaplen cuts the copy
+void Tap_ring::data(uint64_t conn_id, bool to_client, const char *data, size_t len)
+{
+    uint32_t kept = snaplen_ > 0 ? std::min<size_t>(len, snaplen_) : len;
+    Tap_record *record = append(TAP_DATA, conn_id, kept);
+    if (!record)
+        return;
+    record->direction = to_client ? TAP_TO_CLIENT : TAP_TO_UPSTREAM;
+    record->orig_length = len;
+    memcpy(record + 1, data, kept);
+    commit();
+}
+
+void Tap_ring::close(uint64_t conn_id)
+{
+    if (append(TAP_CLOSE, conn_id, 0))
+        commit();
+}
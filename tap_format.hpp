@@ -0,0 +1,72 @@
+#pragma once
+
+/**
+ * Layout of a tap ring file, config.json "tap". Each worker writes its own
+ * file, "<path>.<worker id>", mapped shared: a Tap_header, then capacity
+ * bytes of records. Shared with tools/tap2pcapng.cpp. conn_id is unique
+ * across workers: a handshake stolen by another worker goes on in that
+ * worker's ring under the same conn_id.
+ *
+ * write_pos and read_pos only grow; a record starts at pos % capacity and
+ * never wraps, a TAP_PAD record fills the rest of the ring instead. The
+ * worker is the only writer and stores write_pos (release) after the
+ * record. A reader loads write_pos (acquire), reads up to it and may store
+ * read_pos to free the space again; with no reader the ring fills once and
+ * further records are dropped and counted. Native byte order.
+ */
+
+#include <stdint.h>
+
+static const char TAP_MAGIC[8] = {'P', 'X', 'Y', 'T', 'A', 'P', '0', '1'};
+static const uint32_t TAP_VERSION = 1;
+
+struct Tap_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size; // records start at this offset in the file
+    uint64_t capacity;    // bytes of records, a multiple of 8
+    uint64_t write_pos;
+    uint64_t read_pos;
+    uint64_t records;       // written
+    uint64_t dropped;       // did not fit
+    uint64_t dropped_bytes; // payload of those
+    uint32_t worker;
+    uint32_t snaplen; // payload kept per record, 0 = all
+};
+
+enum Tap_type : uint16_t
+{
+    TAP_PAD = 0,   // skip size bytes
+    TAP_OPEN = 1,  // payload: Tap_open
+    TAP_DATA = 2,  // payload: relayed bytes, after TLS decryption
+    TAP_CLOSE = 3, // no payload
+};
+
+enum Tap_direction : uint16_t
+{
+    TAP_TO_UPSTREAM = 0,
+    TAP_TO_CLIENT = 1,
+};
+
+// Every record; payload follows, the whole padded to 8 bytes
+struct Tap_record
+{
+    uint32_t size; // header + payload + padding
+    uint16_t type;
+    uint16_t direction;
+    uint64_t conn_id;      // worker id << 48 | sequence
+    uint64_t timestamp_ns; // CLOCK_REALTIME
+    uint32_t length;       // payload bytes that follow
+    uint32_t orig_length;  // TAP_DATA: bytes relayed, before the snaplen cut
+};
+static_assert(sizeof(Tap_record) == 32, "Tap_record is part of the file format");
+
+// TAP_OPEN payload: addresses as sockaddr_in / sockaddr_in6, zero padded
+struct Tap_open
+{
+    uint8_t client[28];
+    uint8_t upstream[28];
+    char route[64]; // NUL terminated, cut to fit
+};
+static_assert(sizeof(Tap_open) == 120, "Tap_open is part of the file format");
@@ -0,0 +1,64 @@
+/**
+ * Cidr_acl lookups, IPv4 and IPv6 peers against IPv4, IPv6 and IPv4-mapped
+ * IPv6 entries.
+ *
+ *   tests/cidr_acl
+ */
+
+#include "../type.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+static int failed = 0;
+
+static sockaddr_storage peer(const char *addr)
+{
+    sockaddr_storage ss{};
+    auto *in = reinterpret_cast<sockaddr_in *>(&ss);
+    auto *in6 = reinterpret_cast<sockaddr_in6 *>(&ss);
+    if (inet_pton(AF_INET, addr, &in->sin_addr) == 1)
+        in->sin_family = AF_INET;
+    else if (inet_pton(AF_INET6, addr, &in6->sin6_addr) == 1)
+        in6->sin6_family = AF_INET6;
+    return ss;
+}
+
+static void check(const Cidr_acl &acl, const char *addr, bool expected)
+{
+    sockaddr_storage ss = peer(addr);
+    bool got = acl.permit(reinterpret_cast<const sockaddr *>(&ss));
+    printf("%s %-24s %s\n", got == expected ? "ok  " : "FAIL", addr, got ? "allowed" : "denied");
+    if (got != expected)
+        failed = 1;
+}
+
+int main()
+{
+    std::string error;
+    auto acl = Cidr_acl::build({"::ffff:10.0.0.0/104", "2001:db8::/32", "192.0.2.0/24"},
+                               {"::ffff:10.1.2.3", "10.2.0.0/16"}, error);
+    if (!acl)
+    {
+        printf("FAIL build: %s\n", error.c_str());
+        return 1;
+    }
+    check(*acl, "10.9.9.9", true);          // mapped allow entry, IPv4 peer
+    check(*acl, "::ffff:10.9.9.9", true);   // mapped allow entry, mapped peer
+    check(*acl, "10.1.2.3", false);         // mapped deny entry
+    check(*acl, "::ffff:10.2.3.4", false);  // IPv4 deny entry, mapped peer
+    check(*acl, "192.0.2.7", true);
+    check(*acl, "::ffff:192.0.2.7", true);
+    check(*acl, "2001:db8::1", true);
+    check(*acl, "2001:db9::1", false);
+    check(*acl, "11.0.0.1", false);
+
+    for (const char *bad : {"::ffff:10.0.0.0/129", "10.0.0.0/33", "10.0.0.0/-8", "ten"})
+    {
+        bool rejected = !Cidr_acl::build({bad}, {}, error);
+        printf("%s reject %s\n", rejected ? "ok  " : "FAIL", bad);
+        if (!rejected)
+            failed = 1;
+    }
+    return failed;
+}
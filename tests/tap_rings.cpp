@@ -0,0 +1,173 @@
+/**
+ * tap2pcapng across rings: a connection opened in one worker's ring goes
+ * on in another's, as a stolen handshake does, and in a later --consume
+ * run. Every packet must carry the addresses from its TAP_OPEN.
+ *
+ *   tests/tap_rings [tap2pcapng]
+ */
+
+#include "../tap_format.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <string>
+#include <utility>
+#include <vector>
+
+static const uint64_t CAPACITY = 4096;
+
+static std::string dir;
+static int failed = 0;
+
+/* ================= ring files ================= */
+
+static void append(const std::string &path, uint16_t type, uint16_t direction, uint64_t conn_id,
+                   uint64_t timestamp_ns, const void *payload, uint32_t length)
+{
+    Tap_header header;
+    std::vector<char> data(CAPACITY);
+    if (FILE *f = fopen(path.c_str(), "rb"))
+    {
+        fread(&header, sizeof(header), 1, f);
+        fread(data.data(), 1, CAPACITY, f);
+        fclose(f);
+    }
+    else
+    {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, TAP_MAGIC, sizeof(TAP_MAGIC));
+        header.version = TAP_VERSION;
+        header.header_size = sizeof(header);
+        header.capacity = CAPACITY;
+    }
+
+    Tap_record record{};
+    record.size = (sizeof(record) + length + 7) & ~7u;
+    record.type = type;
+    record.direction = direction;
+    record.conn_id = conn_id;
+    record.timestamp_ns = timestamp_ns;
+    record.length = record.orig_length = length;
+    memcpy(data.data() + header.write_pos, &record, sizeof(record));
+    memcpy(data.data() + header.write_pos + sizeof(record), payload, length);
+    header.write_pos += record.size;
+    header.records++;
+
+    FILE *f = fopen(path.c_str(), "wb");
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(data.data(), 1, CAPACITY, f);
+    fclose(f);
+}
+
+static void open_record(const std::string &path, uint64_t conn_id, uint64_t timestamp_ns)
+{
+    Tap_open open{};
+    sockaddr_in client{}, upstream{};
+    client.sin_family = upstream.sin_family = AF_INET;
+    inet_pton(AF_INET, "192.0.2.1", &client.sin_addr);
+    client.sin_port = htons(40000);
+    inet_pton(AF_INET, "198.51.100.2", &upstream.sin_addr);
+    upstream.sin_port = htons(443);
+    memcpy(open.client, &client, sizeof(client));
+    memcpy(open.upstream, &upstream, sizeof(upstream));
+    strcpy(open.route, "test");
+    append(path, TAP_OPEN, 0, conn_id, timestamp_ns, &open, sizeof(open));
+}
+
+/* ================= pcapng ================= */
+
+// IPv4 source and destination of every packet in the file
+static std::vector<std::pair<std::string, std::string>> packets(const std::string &path)
+{
+    std::vector<std::pair<std::string, std::string>> result;
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return result;
+    std::string b;
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0)
+        b.append(chunk, n);
+    fclose(f);
+
+    for (size_t pos = 0; pos + 8 <= b.size();)
+    {
+        uint32_t type, length;
+        memcpy(&type, b.data() + pos, 4);
+        memcpy(&length, b.data() + pos + 4, 4);
+        if (length < 12 || pos + length > b.size())
+            break;
+        if (type == 6 && length >= 28 + 20)
+        {
+            const char *ip = b.data() + pos + 28;
+            char src[INET_ADDRSTRLEN], dst[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, ip + 12, src, sizeof(src));
+            inet_ntop(AF_INET, ip + 16, dst, sizeof(dst));
+            result.emplace_back(src, dst);
+        }
+        pos += length;
+    }
+    return result;
+}
+
+static void check(const char *name, const std::string &pcapng, size_t expected)
+{
+    auto got = packets(pcapng);
+    bool ok = got.size() == expected;
+    for (const auto &[src, dst] : got)
+        if (!((src == "192.0.2.1" && dst == "198.51.100.2") || (src == "198.51.100.2" && dst == "192.0.2.1")))
+        {
+            printf("     %s: packet %s -> %s\n", name, src.c_str(), dst.c_str());
+            ok = false;
+        }
+    printf("%s %s: %zu packets, expected %zu\n", ok ? "ok  " : "FAIL", name, got.size(), expected);
+    if (!ok)
+        failed = 1;
+}
+
+static int run(const std::string &tool, const std::string &args)
+{
+    std::string command = tool + " " + args + " 2>/dev/null";
+    return system(command.c_str());
+}
+
+int main(int argc, char *argv[])
+{
+    std::string tool = argc > 1 ? argv[1] : "./tap2pcapng";
+    char path[] = "/tmp/tap_rings.XXXXXX";
+    if (!mkdtemp(path))
+    {
+        perror("mkdtemp");
+        return EXIT_FAILURE;
+    }
+    dir = path;
+    const char hello[] = "hello";
+    uint64_t id = 1;
+
+    // opened and closed by worker 0, data relayed by worker 1 in between
+    std::string ring0 = dir + "/merge.0", ring1 = dir + "/merge.1";
+    open_record(ring0, id, 100);
+    append(ring1, TAP_DATA, TAP_TO_UPSTREAM, id, 200, hello, sizeof(hello));
+    append(ring0, TAP_CLOSE, 0, id, 300, nullptr, 0);
+    run(tool, dir + "/merge.pcapng " + ring0 + " " + ring1);
+    check("one connection, two rings", dir + "/merge.pcapng", 3 + 1 + 2);
+
+    // the TAP_OPEN consumed by a run before the rest was written
+    ring0 = dir + "/consume.0", ring1 = dir + "/consume.1";
+    open_record(ring0, id, 100);
+    run(tool, "--consume " + dir + "/first.pcapng " + ring0 + " " + ring1);
+    append(ring1, TAP_DATA, TAP_TO_CLIENT, id, 200, hello, sizeof(hello));
+    append(ring0, TAP_CLOSE, 0, id, 300, nullptr, 0);
+    run(tool, "--consume " + dir + "/second.pcapng " + ring0 + " " + ring1);
+    check("first --consume run", dir + "/first.pcapng", 3);
+    check("second --consume run", dir + "/second.pcapng", 1 + 2);
+
+    std::string cleanup = "rm -rf " + dir;
+    system(cleanup.c_str());
+    return failed;
+}
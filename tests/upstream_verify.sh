@@ -0,0 +1,67 @@
+#!/bin/bash
+# Upstream certificate checks with upstream_ca: the backend's certificate
+# comes from the trusted CA, but only routes whose expected name is on it
+# may reach the backend.
+#
+#   tests/upstream_verify.sh [proxy_server]
+#
+# Needs the openssl command line tool; ports 18440-18450 on 127.0.0.1.
+
+set -u
+proxy=$(realpath "${1:-./proxy_server}")
+dir=$(mktemp -d)
+trap 'kill $(jobs -p) 2>/dev/null; wait 2>/dev/null; rm -rf "$dir"' EXIT
+cd "$dir"
+
+# a CA, and a certificate it signed for each backend: one name only
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=test-ca -keyout ca.key -out ca.crt 2>/dev/null
+backend()
+{
+    openssl req -newkey rsa:2048 -nodes -subj /CN=backend -keyout $1.key -out $1.csr 2>/dev/null
+    printf 'subjectAltName=%s\n' "$2" > $1.ext
+    openssl x509 -req -in $1.csr -CA ca.crt -CAkey ca.key -CAcreateserial -days 1 -extfile $1.ext -out $1.crt 2>/dev/null
+    # answers every line with the line reversed
+    openssl s_server -quiet -rev -accept 127.0.0.1:$3 -cert $1.crt -key $1.key >/dev/null 2>&1 &
+}
+backend named DNS:backend.test 18440
+backend numbered IP:127.0.0.1 18450
+
+route()
+{
+    printf '{"name": "%s", "listen": ["127.0.0.1:%s"], "mode": "plain", "proxy_pass": %s,
+              "upstream_tls": true, "upstream_ca": "%s/ca.crt"%s}' "$1" "$2" "$3" "$dir" "$4"
+}
+cat > config.json <<EOF
+{"metrics_interval": 0, "routes": [
+  $(route right 18441 18440 ', "upstream_sni": "backend.test"'),
+  $(route wrong 18442 18440 ', "upstream_sni": "other.test"'),
+  $(route no_sni 18443 18440 ''),
+  $(route address 18444 18450 '')]}
+EOF
+"$proxy" > proxy.log 2>&1 &
+sleep 1
+
+failed=0
+# expect: "pass" when the line comes back reversed, "fail" when the proxy drops it
+check()
+{
+    local got=""
+    exec 3<> /dev/tcp/127.0.0.1/$2
+    printf 'hello\n' >&3
+    read -t 3 got <&3 2>/dev/null
+    exec 3<&-
+    if [ "$got" = "olleh" ]; then result=pass; else result=fail; fi
+    if [ "$result" = "$3" ]; then
+        echo "ok   $1: $result"
+    else
+        echo "FAIL $1: $result, expected $3"
+        failed=1
+    fi
+}
+check "name on the certificate" 18441 pass
+check "valid CA, wrong upstream_sni" 18442 fail
+check "valid CA, no upstream_sni, 127.0.0.1 not on the certificate" 18443 fail
+check "no upstream_sni, 127.0.0.1 on the certificate" 18444 pass
+
+[ $failed = 0 ] || cat proxy.log
+exit $failed
@@ -0,0 +1,312 @@
+/**
+ * proxy_top: live view of a running proxy from its stats segment (see
+ * stats_format.hpp), without touching the proxy itself.
+ *
+ *   proxy_top [-d seconds] [-n count] [-r] stats-file
+ *
+ * Every -d seconds (default 1) it copies the segment and prints the proxy
+ * wide gauges and one line per worker, with rates over the last interval.
+ * -n stops after count samples, -r prints "name value" lines instead of
+ * the table, for scripts and exporters. The screen is only cleared when
+ * stdout is a terminal.
+ */
+
+#include "../stats_format.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+static uint64_t now_ns(clockid_t clock)
+{
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* ================= segment ================= */
+
+struct Segment
+{
+    const char *base = nullptr;
+    size_t size = 0;
+    ino_t inode = 0;
+    Stats_header header{};
+};
+
+static void unmap(Segment &segment)
+{
+    if (segment.base)
+        munmap(const_cast<char *>(segment.base), segment.size);
+    segment = Segment{};
+}
+
+/**
+ * Map path read-only and check its header.
+ * return: 0 mapped, -1 not there (yet) or not a stats segment
+ */
+static int map_segment(const char *path, Segment &segment, std::string &error)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        error = std::string(path) + ": " + strerror(errno);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < sizeof(Stats_header))
+    {
+        close(fd);
+        error = std::string(path) + ": too short for a stats segment";
+        return -1;
+    }
+    void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        error = std::string(path) + ": mmap failed: " + strerror(errno);
+        return -1;
+    }
+
+    Segment mapped;
+    mapped.base = static_cast<const char *>(map);
+    mapped.size = st.st_size;
+    mapped.inode = st.st_ino;
+    memcpy(&mapped.header, map, sizeof(mapped.header));
+    const Stats_header &h = mapped.header;
+    if (memcmp(h.magic, STATS_MAGIC, sizeof(STATS_MAGIC)) != 0 || h.version != STATS_VERSION ||
+        h.server_offset + (uint64_t)h.server_size > mapped.size ||
+        h.worker_offset + (uint64_t)h.worker_size * h.worker_count > mapped.size)
+    {
+        error = std::string(path) + ": not a stats segment of version " + std::to_string(STATS_VERSION);
+        munmap(map, mapped.size);
+        return -1;
+    }
+    unmap(segment);
+    segment = mapped;
+    return 0;
+}
+
+// The proxy recreates the file at startup; follow it to the new one
+static bool replaced(const char *path, const Segment &segment)
+{
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_ino != segment.inode;
+}
+
+struct Sample
+{
+    uint64_t taken_ns; // CLOCK_MONOTONIC, as updated_ns
+    Stats_server server{};
+    std::vector<Stats_worker> workers;
+};
+
+static bool take_sample(const Segment &segment, Sample &sample)
+{
+    const Stats_header &h = segment.header;
+    sample.taken_ns = now_ns(CLOCK_MONOTONIC);
+    sample.server = Stats_server{};
+    if (!stats_read(&sample.server, segment.base + h.server_offset, std::min<size_t>(h.server_size, sizeof(Stats_server))))
+        return false;
+    sample.workers.assign(h.worker_count, Stats_worker{});
+    for (uint32_t i = 0; i < h.worker_count; ++i)
+    {
+        const char *block = segment.base + h.worker_offset + (size_t)i * h.worker_size;
+        if (!stats_read(&sample.workers[i], block, std::min<size_t>(h.worker_size, sizeof(Stats_worker))))
+            return false;
+    }
+    return true;
+}
+
+/* ================= output ================= */
+
+static double rate(uint64_t now, uint64_t before, double seconds)
+{
+    return seconds > 0 && now >= before ? (now - before) / seconds : 0.0;
+}
+
+static void print_raw(const Sample &sample)
+{
+    const Stats_server &s = sample.server;
+    const std::pair<const char *, uint64_t> server[] = {
+        {"connections", s.connections},
+        {"pending_handshakes", s.pending_handshakes},
+        {"max_connections", s.max_connections},
+        {"max_handshakes", s.max_handshakes},
+        {"draining", s.draining},
+        {"client_verify_ok", s.client_verify_ok},
+        {"client_verify_failed", s.client_verify_failed},
+        {"verify_cache_hits", s.verify_cache_hits},
+        {"verify_cache_misses", s.verify_cache_misses},
+        {"offloaded_handshakes", s.offloaded_handshakes},
+        {"stolen_handshakes", s.stolen_handshakes},
+        {"shed_acl", s.shed_acl},
+        {"shed_connection_limit", s.shed_connection_limit},
+        {"shed_handshake_limit", s.shed_handshake_limit},
+        {"shed_accept_rate", s.shed_accept_rate},
+        {"shed_ip_rate", s.shed_ip_rate},
+        {"relay_reads", s.relay_reads},
+        {"relay_writes", s.relay_writes},
+        {"zerocopy_sends", s.zerocopy_sends},
+        {"zerocopy_copied", s.zerocopy_copied}};
+    for (auto &[name, value] : server)
+        printf("%s %llu\n", name, (unsigned long long)value);
+
+    for (size_t i = 0; i < sample.workers.size(); ++i)
+    {
+        const Stats_worker &w = sample.workers[i];
+        const std::pair<const char *, uint64_t> worker[] = {
+            {"connections", w.connections},
+            {"load", w.load},
+            {"pending_handshakes", w.pending_handshakes},
+            {"queued_handshakes", w.queued_handshakes},
+            {"ready", w.ready},
+            {"accepted", w.accepted},
+            {"closed", w.closed},
+            {"handshakes", w.handshakes},
+            {"bytes_in", w.bytes_in},
+            {"bytes_out", w.bytes_out},
+            {"batches", w.batches},
+            {"pool_blocks", w.pool_blocks},
+            {"relay_reads", w.relay_reads},
+            {"relay_writes", w.relay_writes}};
+        printf("worker.%zu.cpu %lld\n", i, (long long)w.cpu);
+        for (auto &[name, value] : worker)
+            printf("worker.%zu.%s %llu\n", i, name, (unsigned long long)value);
+    }
+    fflush(stdout);
+}
+
+static void print_table(const Segment &segment, const Sample &sample, const Sample *last, bool clear)
+{
+    const Stats_header &h = segment.header;
+    const Stats_server &s = sample.server;
+    double seconds = last ? (sample.taken_ns - last->taken_ns) / 1e9 : 0.0;
+    uint64_t up = (now_ns(CLOCK_REALTIME) - h.started_ns) / 1000000000ull;
+    bool alive = kill(h.pid, 0) == 0 || errno == EPERM;
+
+    if (clear)
+        printf("\033[H\033[2J");
+    printf("pid %llu%s, up %llu:%02llu:%02llu, %u workers\n",
+           (unsigned long long)h.pid, alive ? "" : " (exited)",
+           (unsigned long long)(up / 3600), (unsigned long long)(up / 60 % 60), (unsigned long long)(up % 60),
+           h.worker_count);
+    printf("connections %llu/%s  handshakes %llu/%s%s\n",
+           (unsigned long long)s.connections, s.max_connections ? std::to_string(s.max_connections).c_str() : "-",
+           (unsigned long long)s.pending_handshakes, s.max_handshakes ? std::to_string(s.max_handshakes).c_str() : "-",
+           s.draining ? "  draining" : "");
+    printf("shed acl %llu conn_limit %llu hs_limit %llu accept_rate %llu ip_rate %llu  verify ok %llu failed %llu  stolen %llu\n\n",
+           (unsigned long long)s.shed_acl, (unsigned long long)s.shed_connection_limit,
+           (unsigned long long)s.shed_handshake_limit, (unsigned long long)s.shed_accept_rate,
+           (unsigned long long)s.shed_ip_rate, (unsigned long long)s.client_verify_ok,
+           (unsigned long long)s.client_verify_failed, (unsigned long long)s.stolen_handshakes);
+
+    printf("%6s %4s %7s %5s %6s %5s %9s %9s %8s %9s %9s %9s %6s\n",
+           "worker", "cpu", "conns", "hs", "queued", "ready", "accept/s", "close/s", "tls/s", "in MB/s", "out MB/s", "batch/s", "age");
+    Stats_worker total{};
+    double rates[6] = {};
+    for (size_t i = 0; i < sample.workers.size(); ++i)
+    {
+        const Stats_worker &w = sample.workers[i];
+        const Stats_worker &b = last && i < last->workers.size() ? last->workers[i] : w;
+        double r[6] = {rate(w.accepted, b.accepted, seconds),
+                       rate(w.closed, b.closed, seconds),
+                       rate(w.handshakes, b.handshakes, seconds),
+                       rate(w.bytes_in, b.bytes_in, seconds) / 1e6,
+                       rate(w.bytes_out, b.bytes_out, seconds) / 1e6,
+                       rate(w.batches, b.batches, seconds)};
+        // how long the worker has not published: idle, or stuck
+        double age = w.updated_ns && sample.taken_ns > w.updated_ns ? (sample.taken_ns - w.updated_ns) / 1e9 : 0.0;
+        printf("%6zu %4s %7llu %5llu %6llu %5llu %9.1f %9.1f %8.1f %9.2f %9.2f %9.0f %5.1fs\n",
+               i, w.cpu < 0 ? "-" : std::to_string(w.cpu).c_str(),
+               (unsigned long long)w.connections, (unsigned long long)w.pending_handshakes,
+               (unsigned long long)w.queued_handshakes, (unsigned long long)w.ready,
+               r[0], r[1], r[2], r[3], r[4], r[5], age);
+        total.connections += w.connections;
+        total.pending_handshakes += w.pending_handshakes;
+        total.queued_handshakes += w.queued_handshakes;
+        total.ready += w.ready;
+        for (int k = 0; k < 6; ++k)
+            rates[k] += r[k];
+    }
+    printf("%6s %4s %7llu %5llu %6llu %5llu %9.1f %9.1f %8.1f %9.2f %9.2f %9.0f\n",
+           "total", "", (unsigned long long)total.connections, (unsigned long long)total.pending_handshakes,
+           (unsigned long long)total.queued_handshakes, (unsigned long long)total.ready,
+           rates[0], rates[1], rates[2], rates[3], rates[4], rates[5]);
+    fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+    double interval = 1.0;
+    long count = 0;
+    bool raw = false;
+    int opt;
+    while ((opt = getopt(argc, argv, "d:n:r")) != -1)
+    {
+        if (opt == 'd')
+            interval = atof(optarg);
+        else if (opt == 'n')
+            count = atol(optarg);
+        else if (opt == 'r')
+            raw = true;
+        else
+            optind = argc + 1;
+    }
+    if (optind != argc - 1 || interval <= 0 || count < 0)
+    {
+        fprintf(stderr, "usage: %s [-d seconds] [-n count] [-r] stats-file\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    const char *path = argv[optind];
+
+    Segment segment;
+    std::string error;
+    if (map_segment(path, segment, error) < 0)
+    {
+        fprintf(stderr, "%s\n", error.c_str());
+        return EXIT_FAILURE;
+    }
+
+    bool clear = !raw && isatty(STDOUT_FILENO);
+    Sample last;
+    bool have_last = false;
+    for (long n = 0; count == 0 || n < count; ++n)
+    {
+        if (n > 0)
+        {
+            timespec pause{(time_t)interval, (long)((interval - (time_t)interval) * 1e9)};
+            nanosleep(&pause, nullptr);
+            if (replaced(path, segment) && map_segment(path, segment, error) == 0)
+                have_last = false;
+        }
+
+        Sample sample;
+        if (!take_sample(segment, sample))
+        {
+            fprintf(stderr, "%s: stats segment busy, skipped a sample\n", path);
+            continue;
+        }
+        if (raw)
+            print_raw(sample);
+        else
+            print_table(segment, sample, have_last ? &last : nullptr, clear);
+        last = std::move(sample);
+        have_last = true;
+    }
+    unmap(segment);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,472 @@
+/**
+ * tap2pcapng: turn tap ring files (see tap_format.hpp) into one pcapng
+ * file for Wireshark.
+ *
+ *   tap2pcapng [--consume] out.pcapng ring-file...
+ *
+ * Every tapped connection becomes a TCP flow from the client address to
+ * the upstream address: SYN / SYN-ACK / ACK at TAP_OPEN, the decrypted
+ * payload as PSH-ACK segments, FIN both ways at TAP_CLOSE. IP and TCP
+ * headers are made up, TCP checksums are left at 0. Records of all rings
+ * are taken oldest first, so a connection that moved to another worker
+ * stays one flow.
+ *
+ * --consume moves each ring's read_pos past what was converted, so a
+ * running proxy can write again; without it the files are only read. It
+ * also keeps the connections still open in "<path>.flows" next to the
+ * first ring ("/dev/shm/tap.0" -> "/dev/shm/tap.flows"): their TAP_OPEN
+ * is consumed, the next run reads their addresses from there.
+ */
+
+#include "../tap_format.hpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Keeps the IPv4 total length and the IPv6 payload length in range
+static const uint32_t MAX_SEGMENT = 32768;
+
+static const uint8_t TCP_FIN = 0x01, TCP_SYN = 0x02, TCP_PSH = 0x08, TCP_ACK = 0x10;
+
+/* ================= pcapng ================= */
+
+static void put(std::string &out, const void *data, size_t len)
+{
+    out.append(static_cast<const char *>(data), len);
+}
+
+template <typename T>
+static void put(std::string &out, T value)
+{
+    put(out, &value, sizeof(value));
+}
+
+static void write_section_header(FILE *f)
+{
+    std::string b;
+    put<uint32_t>(b, 0x0A0D0D0A);
+    put<uint32_t>(b, 28);
+    put<uint32_t>(b, 0x1A2B3C4D);
+    put<uint16_t>(b, 1);
+    put<uint16_t>(b, 0);
+    put<int64_t>(b, -1); // section length unknown
+    put<uint32_t>(b, 28);
+
+    // LINKTYPE_RAW: packets start with the IP header; timestamps in ns
+    put<uint32_t>(b, 1);
+    put<uint32_t>(b, 32);
+    put<uint16_t>(b, 101);
+    put<uint16_t>(b, 0);
+    put<uint32_t>(b, 0);
+    put<uint16_t>(b, 9); // if_tsresol
+    put<uint16_t>(b, 1);
+    put<uint32_t>(b, 9);
+    put<uint32_t>(b, 0); // opt_endofopt
+    put<uint32_t>(b, 32);
+    fwrite(b.data(), 1, b.size(), f);
+}
+
+static void write_packet(FILE *f, uint64_t timestamp_ns, const std::string &packet, uint32_t orig_len)
+{
+    uint32_t padded = (packet.size() + 3) & ~3u;
+    uint32_t total = 32 + padded;
+    std::string b;
+    put<uint32_t>(b, 6);
+    put<uint32_t>(b, total);
+    put<uint32_t>(b, 0);
+    put<uint32_t>(b, timestamp_ns >> 32);
+    put<uint32_t>(b, timestamp_ns & 0xffffffff);
+    put<uint32_t>(b, packet.size());
+    put<uint32_t>(b, orig_len);
+    b += packet;
+    b.append(padded - packet.size(), '\0');
+    put<uint32_t>(b, total);
+    fwrite(b.data(), 1, b.size(), f);
+}
+
+/* ================= flows ================= */
+
+struct Endpoint
+{
+    uint8_t addr[16]; // IPv6, or IPv4 mapped
+    uint16_t port;    // network order
+};
+
+struct Flow
+{
+    Endpoint client;
+    Endpoint upstream;
+    bool v4; // both ends IPv4
+    uint32_t seq[2]; // next sequence number, by Tap_direction
+};
+
+static Endpoint endpoint_of(const uint8_t *raw, bool &v4)
+{
+    Endpoint e{};
+    sockaddr_in in4;
+    sockaddr_in6 in6;
+    memcpy(&in4, raw, sizeof(in4));
+    memcpy(&in6, raw, sizeof(in6));
+    if (in4.sin_family == AF_INET)
+    {
+        e.addr[10] = e.addr[11] = 0xff;
+        memcpy(e.addr + 12, &in4.sin_addr, 4);
+        e.port = in4.sin_port;
+    }
+    else if (in6.sin6_family == AF_INET6)
+    {
+        memcpy(e.addr, &in6.sin6_addr, 16);
+        e.port = in6.sin6_port;
+        v4 = false;
+    }
+    return e;
+}
+
+static uint16_t ip_checksum(const uint8_t *data, size_t len)
+{
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return htons(~sum);
+}
+
+/**
+ * One made-up segment of flow in direction dir: IP and TCP header, then
+ * the captured part of the payload. orig_len is what the wire carried.
+ */
+static void write_segment(FILE *f, Flow &flow, int dir, uint8_t flags, uint64_t timestamp_ns,
+                          const char *payload, uint32_t captured, uint32_t length)
+{
+    const Endpoint &src = dir == TAP_TO_UPSTREAM ? flow.client : flow.upstream;
+    const Endpoint &dst = dir == TAP_TO_UPSTREAM ? flow.upstream : flow.client;
+
+    uint8_t tcp[20] = {};
+    memcpy(tcp, &src.port, 2);
+    memcpy(tcp + 2, &dst.port, 2);
+    uint32_t seq = htonl(flow.seq[dir]);
+    uint32_t ack = htonl(flow.seq[1 - dir]);
+    memcpy(tcp + 4, &seq, 4);
+    memcpy(tcp + 8, &ack, 4);
+    tcp[12] = 5 << 4;
+    tcp[13] = flags;
+    uint16_t window = htons(65535);
+    memcpy(tcp + 14, &window, 2);
+
+    std::string packet;
+    uint32_t header_len;
+    if (flow.v4)
+    {
+        uint8_t ip[20] = {};
+        uint16_t total = htons(20 + 20 + length);
+        ip[0] = 0x45;
+        memcpy(ip + 2, &total, 2);
+        ip[8] = 64;
+        ip[9] = IPPROTO_TCP;
+        memcpy(ip + 12, src.addr + 12, 4);
+        memcpy(ip + 16, dst.addr + 12, 4);
+        uint16_t sum = ip_checksum(ip, sizeof(ip));
+        memcpy(ip + 10, &sum, 2);
+        put(packet, ip, sizeof(ip));
+        header_len = 40;
+    }
+    else
+    {
+        uint8_t ip[40] = {};
+        uint16_t payload_len = htons(20 + length);
+        ip[0] = 0x60;
+        memcpy(ip + 4, &payload_len, 2);
+        ip[6] = IPPROTO_TCP;
+        ip[7] = 64;
+        memcpy(ip + 8, src.addr, 16);
+        memcpy(ip + 24, dst.addr, 16);
+        put(packet, ip, sizeof(ip));
+        header_len = 60;
+    }
+    put(packet, tcp, sizeof(tcp));
+    put(packet, payload, captured);
+    write_packet(f, timestamp_ns, packet, header_len + length);
+
+    flow.seq[dir] += length + ((flags & (TCP_SYN | TCP_FIN)) ? 1 : 0);
+}
+
+// A connection whose TAP_OPEN was dropped still gets a flow of its own
+static Flow unknown_flow(uint64_t conn_id)
+{
+    Flow flow{};
+    flow.v4 = true;
+    flow.client.addr[10] = flow.client.addr[11] = 0xff;
+    flow.client.addr[12] = 10;
+    flow.client.addr[15] = 1;
+    flow.client.port = htons(10000 + conn_id % 50000);
+    flow.upstream = flow.client;
+    flow.upstream.addr[15] = 2;
+    flow.upstream.port = htons(1);
+    flow.seq[0] = flow.seq[1] = 1;
+    return flow;
+}
+
+/* ================= ring files ================= */
+
+struct Counts
+{
+    uint64_t records = 0;
+    uint64_t packets = 0;
+    uint64_t dropped = 0;
+};
+
+struct Ring
+{
+    const char *path;
+    char *map = nullptr;
+    size_t size = 0;
+    Tap_header *header = nullptr;
+    const char *data = nullptr;
+    uint64_t pos = 0; // next record
+    uint64_t end = 0; // write_pos when mapped
+};
+
+/**
+ * Map one ring and take its unread range, read_pos to write_pos.
+ * return false when path is not a tap ring.
+ */
+static bool map_ring(const char *path, bool consume, Ring &ring)
+{
+    ring.path = path;
+    int fd = open(path, consume ? O_RDWR : O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(Tap_header))
+    {
+        fprintf(stderr, "%s: %s\n", path, fd < 0 ? strerror(errno) : "too short");
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    void *map = mmap(nullptr, st.st_size, consume ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+        return false;
+    }
+
+    auto *header = static_cast<Tap_header *>(map);
+    if (memcmp(header->magic, TAP_MAGIC, sizeof(TAP_MAGIC)) != 0 || header->version != TAP_VERSION ||
+        header->header_size + header->capacity > (uint64_t)st.st_size)
+    {
+        fprintf(stderr, "%s: not a tap ring (version %u)\n", path, TAP_VERSION);
+        munmap(map, st.st_size);
+        return false;
+    }
+    ring.map = static_cast<char *>(map);
+    ring.size = st.st_size;
+    ring.header = header;
+    ring.data = ring.map + header->header_size;
+    ring.end = __atomic_load_n(&header->write_pos, __ATOMIC_ACQUIRE);
+    ring.pos = header->read_pos;
+    return true;
+}
+
+// The next record of ring past any padding, nullptr at its end
+static const Tap_record *next_record(Ring &ring)
+{
+    while (ring.pos < ring.end)
+    {
+        const auto *record = reinterpret_cast<const Tap_record *>(ring.data + ring.pos % ring.header->capacity);
+        if (record->size < 8 || record->size > ring.header->capacity)
+        {
+            fprintf(stderr, "%s: broken record at %llu\n", ring.path, (unsigned long long)ring.pos);
+            ring.pos = ring.end;
+            return nullptr;
+        }
+        if (record->type != TAP_PAD)
+            return record;
+        ring.pos += record->size;
+    }
+    return nullptr;
+}
+
+static void unmap_ring(Ring &ring, bool consume, Counts &counts)
+{
+    counts.dropped += ring.header->dropped;
+    if (consume)
+        __atomic_store_n(&ring.header->read_pos, ring.end, __ATOMIC_RELEASE);
+    munmap(ring.map, ring.size);
+}
+
+static void convert_record(FILE *out, const Tap_record *record, std::unordered_map<uint64_t, Flow> &flows, Counts &counts)
+{
+    counts.records++;
+    auto it = flows.find(record->conn_id);
+    if (record->type == TAP_OPEN)
+    {
+        const auto *open = reinterpret_cast<const Tap_open *>(record + 1);
+        Flow flow{};
+        flow.v4 = true;
+        flow.client = endpoint_of(open->client, flow.v4);
+        flow.upstream = endpoint_of(open->upstream, flow.v4);
+        flow.seq[0] = flow.seq[1] = 0;
+        flows[record->conn_id] = flow;
+        Flow &f = flows[record->conn_id];
+        write_segment(out, f, TAP_TO_UPSTREAM, TCP_SYN, record->timestamp_ns, nullptr, 0, 0);
+        write_segment(out, f, TAP_TO_CLIENT, TCP_SYN | TCP_ACK, record->timestamp_ns, nullptr, 0, 0);
+        write_segment(out, f, TAP_TO_UPSTREAM, TCP_ACK, record->timestamp_ns, nullptr, 0, 0);
+        counts.packets += 3;
+        return;
+    }
+    if (it == flows.end())
+        it = flows.emplace(record->conn_id, unknown_flow(record->conn_id)).first;
+    Flow &flow = it->second;
+
+    if (record->type == TAP_DATA)
+    {
+        const char *payload = reinterpret_cast<const char *>(record + 1);
+        for (uint32_t off = 0; off < record->orig_length; off += MAX_SEGMENT)
+        {
+            uint32_t length = std::min(MAX_SEGMENT, record->orig_length - off);
+            uint32_t captured = off < record->length ? std::min(length, record->length - off) : 0;
+            write_segment(out, flow, record->direction, TCP_PSH | TCP_ACK, record->timestamp_ns,
+                          payload + off, captured, length);
+            counts.packets++;
+        }
+    }
+    else if (record->type == TAP_CLOSE)
+    {
+        write_segment(out, flow, TAP_TO_UPSTREAM, TCP_FIN | TCP_ACK, record->timestamp_ns, nullptr, 0, 0);
+        write_segment(out, flow, TAP_TO_CLIENT, TCP_FIN | TCP_ACK, record->timestamp_ns, nullptr, 0, 0);
+        counts.packets += 2;
+        flows.erase(it);
+    }
+}
+
+/* ================= flow state ================= */
+
+// "<path>.<worker id>" -> "<path>.flows"
+static std::string state_path(const std::string &ring)
+{
+    size_t dot = ring.find_last_of('.');
+    bool numbered = dot != std::string::npos && dot + 1 < ring.size() &&
+                    ring.find_first_not_of("0123456789", dot + 1) == std::string::npos;
+    return (numbered ? ring.substr(0, dot) : ring) + ".flows";
+}
+
+// Flows left open by the last --consume run; their TAP_OPEN is gone from the rings
+static void load_flows(const std::string &path, std::unordered_map<uint64_t, Flow> &flows)
+{
+    FILE *f = fopen(path.c_str(), "rb");
+    if (!f)
+        return;
+    uint64_t conn_id;
+    Flow flow;
+    while (fread(&conn_id, sizeof(conn_id), 1, f) == 1 && fread(&flow, sizeof(flow), 1, f) == 1)
+        flows[conn_id] = flow;
+    fclose(f);
+}
+
+static bool save_flows(const std::string &path, const std::unordered_map<uint64_t, Flow> &flows)
+{
+    std::string tmp = path + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if (!f)
+    {
+        fprintf(stderr, "%s: %s\n", tmp.c_str(), strerror(errno));
+        return false;
+    }
+    for (const auto &[conn_id, flow] : flows)
+    {
+        fwrite(&conn_id, sizeof(conn_id), 1, f);
+        fwrite(&flow, sizeof(flow), 1, f);
+    }
+    if (fclose(f) != 0 || rename(tmp.c_str(), path.c_str()) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    int first = 1;
+    bool consume = false;
+    if (argc > 1 && strcmp(argv[1], "--consume") == 0)
+    {
+        consume = true;
+        first++;
+    }
+    if (argc - first < 2)
+    {
+        fprintf(stderr, "usage: %s [--consume] out.pcapng ring-file...\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<Ring> rings;
+    int failed = 0;
+    for (int i = first + 1; i < argc; ++i)
+    {
+        Ring ring;
+        if (map_ring(argv[i], consume, ring))
+            rings.push_back(ring);
+        else
+            failed++;
+    }
+
+    FILE *out = fopen(argv[first], "wb");
+    if (!out)
+    {
+        fprintf(stderr, "%s: %s\n", argv[first], strerror(errno));
+        return EXIT_FAILURE;
+    }
+    write_section_header(out);
+
+    std::unordered_map<uint64_t, Flow> flows;
+    std::string state = state_path(argv[first + 1]);
+    load_flows(state, flows);
+
+    // Oldest record of all rings first: a stolen handshake opens in one
+    // worker's ring and goes on in another's
+    Counts counts;
+    while (true)
+    {
+        Ring *oldest = nullptr;
+        const Tap_record *record = nullptr;
+        for (Ring &ring : rings)
+        {
+            const Tap_record *next = next_record(ring);
+            if (next && (!record || next->timestamp_ns < record->timestamp_ns))
+            {
+                oldest = &ring;
+                record = next;
+            }
+        }
+        if (!record)
+            break;
+        convert_record(out, record, flows, counts);
+        oldest->pos += record->size;
+    }
+    fclose(out);
+
+    for (Ring &ring : rings)
+        unmap_ring(ring, consume, counts);
+    if (consume && !save_flows(state, flows))
+        failed++;
+
+    fprintf(stderr, "%llu records, %llu packets, %llu dropped by the proxy\n",
+            (unsigned long long)counts.records, (unsigned long long)counts.packets,
+            (unsigned long long)counts.dropped);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
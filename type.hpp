@@ -5,56 +5,835 @@
 #include <arpa/inet.h>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <coroutine>
+#include <ctime>
 #include <nlohmann/json.hpp>
+#include "./tap_format.hpp"
+#include "./stats_format.hpp"
 
 #include <openssl/ssl.h>
 
 using json = nlohmann::json;
-struct Server_connect_res
+
+class Proxy_server;
+class Worker;
+struct Route;
+
+enum ProxyMode
 {
-    int c_ret;
-    int server_fd;
+    MODE_PLAN = 0,
+    MODE_TLS = 1
 };
 
-struct Config
+// How new clients reach the workers, config.json "accept_mode"
+enum Accept_mode
 {
+    ACCEPT_REUSEPORT = 0, // every worker accepts on its own SO_REUSEPORT sockets
+    ACCEPT_ACCEPTOR = 1   // the main thread accepts and hands fds over
+};
+
+/**
+ * TCP options for one side of the proxy, config.json "socket_options".
+ * -1 leaves the kernel default in place.
+ */
+struct Socket_options
+{
+    int nodelay;
+    int sndbuf;
+    int rcvbuf;
+    int keepalive;
+    int keepidle;
+    int keepintvl;
+    int keepcnt;
+    int user_timeout;  // ms
+    int notsent_lowat; // bytes
+    int fastopen;      // listener: queue length, upstream: on/off
+    int defer_accept;  // listener only, seconds
+};
+
+// config.json "tap": decrypted payload of chosen connections into ring files
+struct Tap_options
+{
+    std::string path; // ring files "<path>.<worker id>"; "" = no tap
+    size_t size;      // ring bytes per worker
+    size_t sample;    // tap 1 in N new connections, 0 = only on admin "tap"
+    size_t snaplen;   // payload kept per read, 0 = all of it
+};
+
+// One listen -> upstream pair; config.json "routes" entries or the top level keys
+struct Route_config
+{
+    std::string name;
+    std::vector<std::string> listen;
+    ProxyMode mode;
     std::string path;
-    int server_listen;
+    std::string client_ca;
+    std::string proxy_host;
     int proxy_pass;
+    bool upstream_tls;
+    std::string upstream_ca;  // verify the upstream against it, by upstream_sni or else proxy_host
+    std::string upstream_sni;
+};
+
+struct Config
+{
+    std::vector<Route_config> routes;
+    bool ipv6_only;
+    int verify_cache_ttl;
+    int verify_cache_size;
+    int metrics_interval;
+    int crypto_threads;
+    int relay_budget;
+    int max_connections;
+    int max_handshakes;
+    int accept_rate;
+    int accept_burst;
+    int ip_rate;
+    int ip_burst;
+    int ip_table_size;
+    int ip_table_shards;
+    int buffer_size;
+    int zerocopy_threshold;
+    int trace_sample;
+    int workers;
+    bool handshake_stealing;
+    Accept_mode accept_mode;
+    std::vector<int> worker_cpus;
+    bool numa_local;
+    bool incoming_cpu;
+    std::vector<int> busy_poll_us;
+    bool coroutines;
+    std::string admin_socket;
+    std::string stats_path;
+    int stats_interval_ms;
+    Socket_options client_socket;
+    Socket_options upstream_socket;
+    Socket_options listener_socket;
+    Tap_options tap;
+    std::vector<std::string> allow;
+    std::vector<std::string> deny;
+};
+
+// Bytes read from one side that the other side has not taken yet. The
+// block is borrowed from Proxy_server::buffer_pool only while data waits.
+// Zeroed when the connection is created; 16 bytes so two fit the hot line.
+struct Pending_data
+{
+    char *block;
+    uint32_t head;     // first byte not written
+    uint32_t tail : 31;
+    uint32_t eof : 1;  // the source closed; finish once data is out
+
+    size_t size() const { return tail - head; }
 };
 
-struct ProxyConnection
+// Client address without the 128 bytes of a sockaddr_storage
+union Peer_address
 {
+    sockaddr sa;
+    sockaddr_in v4;
+    sockaddr_in6 v6;
+};
+
+/**
+ * The per tunnel state every event touches, one cache line. Lives in a
+ * Connection_table slot; the flags are bit-fields, crypto workers only
+ * ever touch ssl.
+ */
+struct alignas(64) ProxyConnection
+{
+    SSL *ssl;
+    SSL *upstream_ssl;
+    Pending_data to_client;
+    Pending_data to_server;
     int client_fd;
     int server_fd;
-    SSL *ssl;
-    bool ssl_accepted;
-    bool server_connected;
-    bool protocol_checked;
+    uint32_t slot; // index in the table, shared with its Connection_meta
+    bool ssl_accepted : 1;
+    bool server_connected : 1;
+    bool protocol_checked : 1;
+    bool upstream_handshaked : 1;
+    bool handshake_in_flight : 1;
+    bool handshake_rearm : 1;
+    bool client_ready : 1;
+    bool server_ready : 1;
 };
+static_assert(sizeof(ProxyConnection) == 64, "ProxyConnection must stay one cache line");
 
-enum ProxyMode
+// What a tunnel keeps for routing, statistics and tracing only
+struct Connection_meta
 {
-    MODE_PLAN = 0,
-    MODE_TLS = 1
+    Route *route;
+    uint64_t bytes_in;    // client -> upstream
+    uint64_t bytes_out;   // upstream -> client
+    uint64_t accepted_ns; // lifecycle timestamps, clock_ns(); 0 = not reached
+    uint64_t handshake_ns;
+    uint64_t upstream_ns;
+    uint64_t first_in_ns;
+    uint64_t first_out_ns;
+    uint64_t tap_id; // 0 = not tapped
+    Peer_address peer;
 };
 
-class Proxy_server
+/**
+ * Live connections: hot and cold halves in two parallel arenas grown a
+ * chunk at a time, so slots never move and freed ones are reused first.
+ * Both fds of a connection index straight to it.
+ */
+class Connection_table
 {
 private:
-    bool enable_tls_;
+    static const size_t CHUNK = 1024;
 
-    int create_socket();
-    SSL_CTX *create_context();
+    std::vector<std::unique_ptr<ProxyConnection[]>> hot_;
+    std::vector<std::unique_ptr<Connection_meta[]>> cold_;
+    std::vector<uint32_t> free_;
+    std::vector<ProxyConnection *> by_fd_;
+    size_t size_;
+
+    void index(int fd, ProxyConnection *conn);
+
+public:
+    Connection_table();
+
+    ProxyConnection *create(int client_fd, Route *route);
+    void set_server_fd(ProxyConnection *conn, int server_fd);
+    void destroy(ProxyConnection *conn);
+
+    ProxyConnection *find(int fd) const
+    {
+        return fd >= 0 && (size_t)fd < by_fd_.size() ? by_fd_[fd] : nullptr;
+    }
+    Connection_meta &meta(const ProxyConnection *conn) const
+    {
+        return cold_[conn->slot / CHUNK][conn->slot % CHUNK];
+    }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    // f(ProxyConnection *, Connection_meta &) for every live connection
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (size_t c = 0; c < hot_.size(); ++c)
+            for (size_t i = 0; i < CHUNK; ++i)
+                if (hot_[c][i].client_fd >= 0)
+                    f(&hot_[c][i], cold_[c][i]);
+    }
+};
+
+/**
+ * Client side session cache for upstream TLS, keyed by backend ("host:port").
+ * Holds one reference on every stored session.
+ */
+class Upstream_session_cache
+{
+private:
+    std::unordered_map<std::string, SSL_SESSION *> sessions_;
+    std::mutex mutex_;
+
+public:
+    ~Upstream_session_cache();
+
+    // a new reference, the caller frees it
+    SSL_SESSION *get(const std::string &backend);
+    void put(const std::string &backend, SSL_SESSION *session);
+    void remove(const std::string &backend);
+};
+
+struct Verify_result
+{
+    bool ok;
+    int error;
+    time_t expires;
+};
+
+/**
+ * Client certificate verification results keyed by the SHA-256 fingerprint
+ * of the leaf, so repeat clients skip chain building until the TTL runs out.
+ * order_ lists the fingerprints oldest first; a full cache drops its front.
+ */
+class Client_verify_cache
+{
+private:
+    struct Entry
+    {
+        Verify_result result;
+        std::list<std::string>::iterator order;
+    };
+
+    std::unordered_map<std::string, Entry> entries_;
+    std::list<std::string> order_;
+    std::mutex mutex_;
+    int ttl_;
+    size_t capacity_;
+
+public:
+    Client_verify_cache();
+
+    void configure(int ttl, size_t capacity);
+    void clear();
+    bool lookup(const std::string &fingerprint, Verify_result &out);
+    void store(const std::string &fingerprint, bool ok, int error, time_t not_after);
+};
+
+// Updated from every worker and crypto thread
+struct Proxy_metrics
+{
+    std::atomic<uint64_t> client_verify_ok;
+    std::atomic<uint64_t> client_verify_failed;
+    std::atomic<uint64_t> verify_cache_hits;
+    std::atomic<uint64_t> verify_cache_misses;
+    std::atomic<uint64_t> offloaded_handshakes;
+    std::atomic<uint64_t> stolen_handshakes;
+    std::atomic<uint64_t> shed_connection_limit;
+    std::atomic<uint64_t> shed_handshake_limit;
+    std::atomic<uint64_t> shed_accept_rate;
+    std::atomic<uint64_t> shed_ip_rate;
+    std::atomic<uint64_t> shed_acl;
+    std::atomic<uint64_t> zerocopy_sends;
+    std::atomic<uint64_t> zerocopy_copied;
+};
+
+/**
+ * Log-linear latency histogram in the HDR style: 16 steps per power of
+ * two, so any percentile is within ~6% of the true value. One per worker,
+ * merged for reporting.
+ */
+class Latency_histogram
+{
+private:
+    static const int SUB_BITS = 4;
+    static const size_t SUB_BUCKETS = 1 << SUB_BITS;
+    static const size_t BUCKETS = 64 * SUB_BUCKETS;
+
+    uint64_t counts_[BUCKETS];
+    uint64_t count_;
+    uint64_t max_;
+
+    static size_t index(uint64_t value);
+    static uint64_t value_at(size_t index);
+
+public:
+    Latency_histogram();
+
+    void record(uint64_t value);
+    void merge(const Latency_histogram &other);
+    uint64_t percentile(double q) const;
+    uint64_t count() const { return count_; }
+    json summary() const;
+};
+
+// Connection phases and loop turns, in microseconds
+struct Latency_metrics
+{
+    Latency_histogram handshake;  // accept -> client TLS done
+    Latency_histogram upstream;   // client ready -> upstream connected (and TLS done)
+    Latency_histogram first_byte; // upstream ready -> first byte back to the client
+    Latency_histogram lifetime;   // accept -> close
+    Latency_histogram loop;       // one epoll batch, wakeup to wait
+
+    void merge(const Latency_metrics &other);
+};
+
+// rate <= 0 means unlimited
+struct Token_bucket
+{
+    double rate;
+    double burst;
+    double tokens;
+    uint64_t last_ns;
+
+    void configure(double rate, double burst);
+    bool take(uint64_t now_ns);
+};
+
+struct Handshake_job
+{
+    Worker *worker;
+    ProxyConnection *conn;
+    int ret;
+    int err;
+};
+
+/**
+ * Runs SSL_accept for client handshakes on crypto threads so private key
+ * operations never stall an event loop. Finished jobs go back to the
+ * worker that submitted them, through its crypto_fd; a connection has at
+ * most one job in flight and its SSL object is not touched by the loop
+ * until the job comes back.
+ */
+class Crypto_pool
+{
+private:
+    std::vector<std::thread> threads_;
+    std::deque<Handshake_job> jobs_;
+    std::mutex jobs_mutex_;
+    std::condition_variable jobs_cv_;
+    bool stopping_;
+
+    void run();
+
+public:
+    explicit Crypto_pool(int threads);
+    ~Crypto_pool();
+
+    void submit(Worker *worker, ProxyConnection *conn);
+    std::vector<Handshake_job> collect(Worker *worker);
+};
+
+/**
+ * Fixed-size relay blocks kept for reuse. A block handed to a
+ * MSG_ZEROCOPY send stays out of the pool until the kernel is done with it.
+ */
+class Buffer_pool
+{
+private:
+    std::vector<char *> free_;
+    std::unordered_set<char *> blocks_;  // every block of block_size_, handed out or free
+    std::unordered_set<char *> retired_; // handed out before a resize, freed on put()
+    size_t block_size_;
+    size_t allocated_;
+
+public:
+    Buffer_pool();
+    ~Buffer_pool();
+
+    void configure(size_t block_size);
+    size_t block_size() const { return block_size_; }
+    size_t allocated() const { return allocated_; }
+
+    char *get();
+    void put(char *block);
+};
+
+/**
+ * A worker's tap ring file, see tap_format.hpp. Only the worker writes;
+ * a record that does not fit is dropped and counted, never waited for.
+ */
+class Tap_ring
+{
+private:
+    int fd_;
+    Tap_header *header_;
+    char *data_;
+    uint64_t capacity_;
+    uint32_t worker_;
+    uint32_t snaplen_;
+    uint64_t next_id_;
+    uint64_t next_pos_; // write_pos once the record in progress is done
+
+    Tap_record *append(uint16_t type, uint64_t conn_id, uint32_t length);
+    void commit();
+
+public:
+    Tap_ring(const std::string &path, int worker, size_t capacity, size_t snaplen);
+    ~Tap_ring();
+
+    uint64_t open(const Connection_meta &meta);
+    void data(uint64_t conn_id, bool to_client, const char *data, size_t len);
+    void close(uint64_t conn_id);
+
+    uint64_t records() const { return header_->records; }
+    uint64_t dropped() const { return header_->dropped; }
+};
+
+/**
+ * The stats segment file, see stats_format.hpp. The main thread writes
+ * the server block, each worker its own; readers only ever map it.
+ */
+class Stats_segment
+{
+private:
+    int fd_;
+    size_t size_;
+    Stats_header *header_;
+
+public:
+    Stats_segment(const std::string &path, int worker_count, int interval_ms);
+    ~Stats_segment();
+
+    Stats_server *server();
+    Stats_worker *worker(int id);
+};
+
+// A plain socket with SO_ZEROCOPY on, and the blocks its sends still pin
+struct Zerocopy_socket
+{
+    uint32_t next_id; // the kernel numbers successful sends from 0
+    std::deque<std::pair<uint32_t, char *>> inflight; // last send id using the block
+    bool copied;  // the kernel copied anyway (loopback, no SG); stop asking
+    bool closing; // connection gone, close once inflight is empty
+};
+
+/**
+ * Local control socket. Commands are single lines, every reply is one
+ * line of JSON; admin_command() in main.cpp does the actual work.
+ */
+class Admin_socket
+{
+private:
+    struct Client
+    {
+        std::string in;
+        std::string out;
+        bool closing;
+    };
+    std::unordered_map<int, Client> clients_;
+    std::string path_;
+
+    void close_client(Proxy_server *server, int fd);
 
 public:
-    int ep_fd;
     int listen_fd;
+
+    Admin_socket(Proxy_server *server, const std::string &path);
+    ~Admin_socket();
+
+    bool owns(int fd) const { return fd == listen_fd || clients_.count(fd) > 0; }
+    void handle(Proxy_server *server, int fd, uint32_t events);
+};
+
+/**
+ * Per source address token buckets in a fixed-size open-addressing table.
+ * The table is split into shards, each with its own lock. A key probes a
+ * short window of its shard and, when neither its own nor a free slot is
+ * there, takes over the least recently seen slot of that window, so memory
+ * stays bounded however many addresses show up.
+ */
+class Ip_rate_limiter
+{
+private:
+    struct Slot
+    {
+        uint64_t hi;
+        uint64_t lo;
+        uint64_t last_ns; // 0 = empty
+        double tokens;
+    };
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::vector<Slot> slots;
+    };
+
+    std::unique_ptr<Shard[]> shards_;
+    size_t shard_count_;
+    size_t slot_mask_;
+    double rate_;
+    double burst_;
+    uint64_t seed_;
+
+public:
+    static constexpr size_t probe_window = 8;
+
+    std::atomic<uint64_t> evictions;
+
+    Ip_rate_limiter();
+
+    void configure(double rate, double burst, size_t capacity, size_t shard_count);
+    bool allow(const sockaddr *addr, uint64_t now_ns);
+};
+
+enum Acl_action : uint8_t
+{
+    ACL_NONE = 0,
+    ACL_ALLOW = 1,
+    ACL_DENY = 2
+};
+
+/**
+ * Longest prefix match over left aligned 128-bit keys (IPv4 uses the top
+ * 32 bits). Poptrie layout: a 2^16 direct-pointing root, then 6-bit
+ * strides whose children and leaves are found by popcount over 64-bit
+ * bitmaps, with runs of equal leaves stored once.
+ */
+class Poptrie
+{
+public:
+    struct Prefix
+    {
+        unsigned __int128 key;
+        int length;
+        uint8_t action;
+    };
+
+    void build(std::vector<Prefix> prefixes);
+    uint8_t lookup(unsigned __int128 key) const;
+    size_t memory() const;
+
+private:
+    struct Node
+    {
+        uint64_t vector;  // slots that continue into a child
+        uint64_t leafvec; // slots where the leaf value changes
+        uint32_t leaf_base;
+        uint32_t child_base;
+    };
+
+    // high bit set: leaf value in the low byte, otherwise a node index
+    std::vector<uint32_t> direct_;
+    std::vector<Node> nodes_;
+    std::vector<uint8_t> leaves_;
+
+    static void build_level(const std::vector<Prefix> &prefixes, int depth, int bits,
+                            uint8_t inherited, std::vector<uint8_t> &values,
+                            std::vector<std::vector<Prefix>> &below);
+    void build_node(const std::vector<Prefix> &prefixes, int depth, uint8_t inherited, uint32_t index);
+};
+
+/**
+ * allow/deny lists from config.json compiled for accept time checks.
+ * Without an allow list everything not denied is let in.
+ */
+class Cidr_acl
+{
+private:
+    Poptrie v4_;
+    Poptrie v6_;
+    bool default_allow_ = true;
+    size_t prefixes_ = 0;
+
+    static bool parse(const std::string &cidr, uint8_t action, Poptrie::Prefix &out, bool &v6);
+
+public:
+    static std::unique_ptr<Cidr_acl> build(const std::vector<std::string> &allow,
+                                           const std::vector<std::string> &deny,
+                                           std::string &error);
+
+    bool permit(const sockaddr *addr) const;
+    size_t prefixes() const { return prefixes_; }
+    size_t memory() const;
+};
+
+/**
+ * Runtime state of one route. Routes only add their SSL_CTXs and listen
+ * sockets; workers, limits and caches are shared.
+ */
+struct Route
+{
+    Route_config config;
+    Proxy_server *server;
     SSL_CTX *context;
-    std::string cert_path;
-    int proxy_server_ip;
+    SSL_CTX *upstream_context;
+    std::string upstream_key;
+    std::string session_key; // upstream session cache: the backend and what its certificate was checked against
+    sockaddr_storage upstream_addr;
+    socklen_t upstream_addr_len;
+    Client_verify_cache verify_cache;
+};
+
+// A server SSL_CTX built off the loop thread, waiting to be swapped in
+struct Context_reload
+{
+    Route *route;
+    SSL_CTX *context;
+};
+
+// A client on its way to a worker: from the acceptor, or a queued
+// handshake moving to whichever worker runs it
+struct Handoff
+{
+    int fd;
+    Route *route;
+    Peer_address peer;
+    uint64_t accepted_ns;
+    bool sniffed;    // first byte already checked against the route mode
+    SSL *ssl;        // set for a queued handshake, nothing has run on it yet
+    uint64_t tap_id; // queued handshake: its tap conn_id, 0 = not tapped
+};
 
-    explicit Proxy_server(Config config, bool enable_tls);
+/**
+ * Lock free single producer, single consumer ring: the acceptor pushes,
+ * the owning worker pops. Capacity is a power of two; push() fails when
+ * the ring is full.
+ */
+class Handoff_queue
+{
+private:
+    std::vector<Handoff> slots_;
+    size_t mask_;
+    alignas(64) std::atomic<size_t> head_; // next to pop, written by the consumer
+    alignas(64) std::atomic<size_t> tail_; // next to fill, written by the producer
+
+public:
+    explicit Handoff_queue(size_t capacity);
+
+    bool push(const Handoff &handoff);
+    bool pop(Handoff &handoff);
+};
+
+// A worker's totals since start; its thread writes, others read under its mutex
+struct Worker_totals
+{
+    uint64_t accepted;
+    uint64_t closed;
+    uint64_t handshakes; // client TLS handshakes done
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t batches;
+    uint64_t relay_reads;
+    uint64_t relay_writes;
+};
+
+// Coroutine mode: the task parked on an fd and the edges it has not seen yet
+struct Fd_waiter
+{
+    std::coroutine_handle<> task;
+    uint32_t events;
+};
+
+/**
+ * One event loop thread: its own epoll set, connections, relay buffer and
+ * histograms. Routes, limits, caches and metrics stay in Proxy_server.
+ * mutex is held while the loop handles a batch of events, so the main
+ * thread can read or retune a worker between batches.
+ */
+class Worker
+{
+private:
+    std::thread thread_;
+    bool busy_poll_refused_; // warned once already
+
+    ssize_t write_side(SSL *ssl, int fd, const char *data, size_t len, int flags);
+    int flush_pending(SSL *ssl, int fd, Pending_data &pending, uint64_t &bytes);
+    void push_corked(int fd, bool to_client);
+    int relay(SSL *src_ssl, int src_fd, SSL *dst_ssl, int dst_fd, Pending_data &pending, uint64_t &bytes, bool to_client, uint64_t tap_id);
+
+public:
+    int id;
+    int cpu;          // pinned to this CPU, -1 = wherever the scheduler puts it
+    int busy_poll_us; // spin on epoll this long before sleeping, 0 = never
+    Proxy_server *server;
+    int ep_fd;
+    int event_fd; // handoffs and drain wake the loop through it
+    int crypto_fd;
+    std::vector<std::pair<int, Route *>> listeners; // reuseport mode only
+    Handoff_queue inbox;
+    std::mutex mutex; // the loop holds it per event; admin and metrics lock it to read the worker
+    std::atomic<size_t> load;       // connections owned or handed over, for least-load choice
+    std::atomic<size_t> handshakes; // TLS connections not through SSL_accept yet
+    std::atomic<bool> finished;
+    Connection_table conns;
+    std::deque<ProxyConnection *> ready_conns; // used up relay_budget, data left
+    Latency_metrics latency;
+    Worker_totals totals;
+    uint64_t traced;
+    std::unique_ptr<Tap_ring> tap;
+    uint64_t tap_seen; // new connections, for tap sampling
+    std::vector<char> relay_buffer;
+    Buffer_pool buffer_pool;
+    std::unordered_map<int, Zerocopy_socket> zerocopy_sockets;
+    std::mutex crypto_mutex;
+    std::vector<Handshake_job> crypto_done; // guarded by crypto_mutex
+    std::mutex steal_mutex;
+    std::deque<Handoff> handshake_queue; // guarded by steal_mutex; front for the owner, back for thieves
+    std::atomic<size_t> queued;          // handshake_queue.size()
+    std::atomic<bool> idle;              // blocked in epoll_wait with nothing to do
+    std::vector<Fd_waiter> fd_waiters;              // coroutine mode, by fd
+    std::deque<std::coroutine_handle<>> ready_tasks; // coroutine mode: used up relay_budget
+
+    Worker(Proxy_server *server, int id, int cpu, int busy_poll_us);
+    ~Worker();
+
+    void start();
+    void place();
+    void join();
+    void wake();
+
+    Route *listener_route(int fd) const;
+    int add_epoll_event(int fd, int ep_ctl_op, uint32_t events);
+    void close_listeners();
+
+    void enable_zerocopy(int fd);
+    void enable_busy_poll(int fd);
+    void publish_stats(uint64_t now);
+    void reap_zerocopy(int fd);
+    void close_socket(int fd);
+
+    int handle_server_side(ProxyConnection *conn, Connection_meta &meta);
+    int handle_client_side(ProxyConnection *conn, Connection_meta &meta);
+};
+
+class Proxy_server
+{
+private:
+    bool ipv6_only_;
+    Socket_options listener_socket_;
+
+    std::thread reload_thread_;
+    std::mutex reload_mutex_;
+    std::vector<Context_reload> reloaded_;
+    bool reload_failed_;
+    bool reload_running_;
+    std::mutex context_mutex_; // Route::context, swapped by install_contexts()
+    size_t next_worker_;
+
+    int create_socket(const std::string &address, bool reuseport);
+    void resolve_upstream(Route &route);
+    SSL_CTX *create_context(Route &route);
+    SSL_CTX *create_upstream_context(const Route_config &config);
+    void build_contexts();
+
+    static int on_new_upstream_session(SSL *ssl, SSL_SESSION *session);
+    static int verify_client_cert(X509_STORE_CTX *store, void *arg);
+
+public:
+    int ep_fd; // main thread: control fds, and listeners in acceptor mode
+    std::vector<int> listen_fds;
+    int timer_fd;
+    int stats_fd; // stats_interval_ms timer
+    int signal_fd;
+    int reload_fd;
+    std::vector<std::unique_ptr<Route>> routes;
+    std::vector<std::pair<int, Route *>> listeners;
+    Accept_mode accept_mode;
+    std::vector<std::unique_ptr<Worker>> workers;
+    bool handshake_stealing;
+    bool numa_local;
+    bool incoming_cpu;
+    bool coroutines; // connections run as tasks, see coroutine.hpp
+    std::unordered_map<int, std::pair<Worker *, Handoff>> sniffing; // acceptor mode, waiting for the first byte
+    Upstream_session_cache upstream_sessions;
+    Proxy_metrics metrics;
+    size_t trace_sample;
+    std::unique_ptr<Crypto_pool> crypto_pool;
+    std::atomic<size_t> relay_budget;
+    std::atomic<size_t> max_connections;
+    std::atomic<size_t> max_handshakes;
+    std::mutex accept_mutex; // accept_bucket
+    Token_bucket accept_bucket;
+    Ip_rate_limiter ip_limiter;
+    std::shared_ptr<const Cidr_acl> acl; // std::atomic_load / atomic_store
+    size_t buffer_size;
+    size_t zerocopy_threshold;
+    std::unique_ptr<Admin_socket> admin;
+    std::atomic<bool> draining;
+    Socket_options client_socket;
+    Socket_options upstream_socket;
+    Tap_options tap;
+    std::unique_ptr<Stats_segment> stats;
+
+    explicit Proxy_server(Config config);
+    ~Proxy_server();
+
+    void start_workers();
+    Worker *least_loaded_worker();
+    Worker *worker_on_cpu(int cpu);
+    size_t connection_count() const;
+    size_t handshake_count() const;
+
+    Route *listener_route(int fd) const;
 
     int add_epoll_event(int fd, int ep_ctl_op, uint32_t events);
 
@@ -62,14 +841,63 @@ public:
 
     void set_nonblocking(int fd);
 
-    int handle_server_side(SSL *ssl, int client_fd, int server_fd);
-    int handle_client_side(SSL *ssl, int client_fd, int server_fd);
+    void report_metrics();
+    void publish_stats();
+
+    void reload();
+    void install_contexts();
+
+    SSL *create_client_ssl(int client_fd, Route &route);
+    SSL *create_upstream_ssl(int server_fd, Route &route);
+    int upstream_handshake(SSL *upstream_ssl);
+
+    void drain();
 };
 
-Server_connect_res start_server_connect(Proxy_server *, const ProxyConnection &, Config);
+uint64_t monotonic_ns();
+
+uint64_t clock_ns();
+
+bool parse_socket_address(const std::string &, sockaddr_storage &, socklen_t &);
+
+std::string format_socket_address(const sockaddr *);
+
+int apply_socket_options(int, const Socket_options &);
+
+int start_server_connect(Worker *, ProxyConnection *);
+
+void worker_loop(Worker *);
+
+int relay_event(Worker *, ProxyConnection *, int);
+
+void run_ready_list(Worker *);
+
+bool admit_connection(Proxy_server *, const Route *, const sockaddr *);
+
+void shed_connection(int);
+
+void reload_config(Proxy_server *);
+
+std::string admin_command(Proxy_server *, const std::string &);
+
+int finish_client_handshake(Worker *, ProxyConnection *, int, int);
+
+void client_handshake_done(Worker *, ProxyConnection *);
+
+int upstream_connected(Worker *, ProxyConnection *);
+
+void mark_upstream_ready(Worker *, ProxyConnection *);
+
+void record_first_bytes(Worker *, Connection_meta &);
+
+void trace_connection(Worker *, const ProxyConnection *, const Connection_meta &);
+
+void close_connection(Worker *, ProxyConnection *);
+
+void from_json(const json &, Socket_options &);
 
-void close_connection(const ProxyConnection *);
+void from_json(const json &, Route_config &);
 
-ProxyConnection *find_conn_by_fd(int);
+void from_json(const json &, Tap_options &);
 
 void from_json(const json &, Config &);
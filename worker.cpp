@@ -0,0 +1,589 @@
+#include "./type.hpp"
+#include "./probes.hpp"
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/errqueue.h>
+#include <linux/mempolicy.h>
+
+#include <algorithm>
+
+#include <openssl/ssl.h>
+
+#include <spdlog/spdlog.h>
+
+/* ================= handoff queue ================= */
+
+Handoff_queue::Handoff_queue(size_t capacity)
+    : head_(0),
+      tail_(0)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+    slots_.resize(size);
+    mask_ = size - 1;
+}
+
+// Producer side: the acceptor thread only
+bool Handoff_queue::push(const Handoff &handoff)
+{
+    size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size())
+        return false;
+    slots_[tail & mask_] = handoff;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+// Consumer side: the owning worker only
+bool Handoff_queue::pop(Handoff &handoff)
+{
+    size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire))
+        return false;
+    handoff = slots_[head & mask_];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+}
+
+/* ================= worker ================= */
+
+Worker::Worker(Proxy_server *server, int id, int cpu, int busy_poll_us)
+    : busy_poll_refused_(false),
+      id(id),
+      cpu(cpu),
+      busy_poll_us(busy_poll_us),
+      server(server),
+      ep_fd(-1),
+      event_fd(-1),
+      crypto_fd(-1),
+      inbox(4096),
+      load(0),
+      handshakes(0),
+      finished(false),
+      totals{},
+      traced(0),
+      tap_seen(0),
+      queued(0),
+      idle(false)
+{
+    // relay_buffer and the tap ring are set up by place(), on the worker's own thread
+    buffer_pool.configure(server->buffer_size);
+
+    ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ep_fd < 0 || event_fd < 0 || add_epoll_event(event_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+    {
+        spdlog::error("worker {}: epoll setup failed", id);
+        exit(EXIT_FAILURE);
+    }
+#ifdef EPIOCSPARAMS
+    // glibc 2.40+ / Linux 6.9+: the kernel polls the NIC queues of this
+    // epoll's sockets itself before putting the thread to sleep
+    if (busy_poll_us > 0)
+    {
+        epoll_params params{};
+        params.busy_poll_usecs = busy_poll_us;
+        params.busy_poll_budget = 8;
+        params.prefer_busy_poll = 1;
+        if (ioctl(ep_fd, EPIOCSPARAMS, &params) < 0)
+            spdlog::warn("worker {}: EPIOCSPARAMS failed: {}", id, strerror(errno));
+    }
+#endif
+
+    if (server->crypto_pool)
+    {
+        crypto_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (crypto_fd < 0 || add_epoll_event(crypto_fd, EPOLL_CTL_ADD, EPOLLIN) < 0)
+        {
+            spdlog::error("worker {}: crypto eventfd setup failed", id);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
+Worker::~Worker()
+{
+    join();
+    close_listeners();
+    for (Handoff &handoff : handshake_queue)
+    {
+        SSL_free(handoff.ssl);
+        close(handoff.fd);
+    }
+    if (crypto_fd >= 0)
+        close(crypto_fd);
+    close(event_fd);
+    close(ep_fd);
+}
+
+void Worker::start()
+{
+    thread_ = std::thread(worker_loop, this);
+}
+
+/**
+ * First thing on the worker thread. Pins it to cpu, then asks for pages on
+ * the node it runs on: MPOL_LOCAL overrides a policy inherited from the
+ * launcher (numactl --interleave and the like). Everything the loop
+ * allocates afterwards, connection table chunks and pool blocks, is first
+ * touched here and lands on that node; the relay buffer and the tap ring,
+ * which MAP_POPULATE faults in whole, are touched now.
+ */
+void Worker::place()
+{
+    if (cpu >= 0)
+    {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0)
+            spdlog::warn("worker {}: can't pin to cpu {}: {}", id, cpu, strerror(err));
+    }
+    if (server->numa_local && syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0) < 0)
+        spdlog::warn("worker {}: set_mempolicy(MPOL_LOCAL) failed: {}", id, strerror(errno));
+
+    std::lock_guard<std::mutex> lock(mutex);
+    // the admin socket may have resized it already
+    if (relay_buffer.empty())
+        relay_buffer.resize(buffer_pool.block_size());
+    if (!server->tap.path.empty())
+        tap = std::make_unique<Tap_ring>(server->tap.path + "." + std::to_string(id), id, server->tap.size, server->tap.snaplen);
+}
+
+void Worker::join()
+{
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void Worker::wake()
+{
+    uint64_t one = 1;
+    if (write(event_fd, &one, sizeof(one)) < 0)
+        spdlog::error("worker {}: eventfd write failed", id);
+}
+
+// nullptr when fd is not one of this worker's listen sockets
+Route *Worker::listener_route(int fd) const
+{
+    for (const auto &[l, route] : listeners)
+    {
+        if (l == fd)
+            return route;
+    }
+    return nullptr;
+}
+
+int Worker::add_epoll_event(int fd, int op, uint32_t events)
+{
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(ep_fd, op, fd, &ev);
+}
+
+// Loop thread only; with SO_REUSEPORT the other workers keep accepting
+void Worker::close_listeners()
+{
+    for (auto &[fd, _] : listeners)
+    {
+        epoll_ctl(ep_fd, EPOLL_CTL_DEL, fd, nullptr);
+        close(fd);
+    }
+    listeners.clear();
+}
+
+/* ================= relay ================= */
+
+/**
+ * Write data to one side, through its SSL when there is one.
+ * return: bytes written, 0 when the socket is full, -1 on error
+ */
+ssize_t Worker::write_side(SSL *ssl, int fd, const char *data, size_t len, int flags)
+{
+    totals.relay_writes++;
+    if (ssl)
+    {
+        // partial writes are on: every finished record counts
+        int n = SSL_write(ssl, data, len);
+        if (n > 0)
+            return n;
+        int err = SSL_get_error(ssl, n);
+        return err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE ? 0 : -1;
+    }
+
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL | flags);
+    if (n >= 0)
+        return n;
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+}
+
+/**
+ * Flush what the destination did not take last time.
+ * return:
+ *   1   -> nothing left
+ *   0   -> the socket filled up again
+ *  -1   -> error
+ */
+int Worker::flush_pending(SSL *ssl, int fd, Pending_data &pending, uint64_t &bytes)
+{
+    while (pending.size() > 0)
+    {
+        // an SSL retry must offer the same bytes again, which it does
+        ssize_t n = write_side(ssl, fd, pending.block + pending.head, pending.size(), 0);
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            return 0;
+        pending.head += n;
+        bytes += n;
+    }
+    if (pending.block)
+        buffer_pool.put(pending.block);
+    pending.block = nullptr;
+    pending.head = 0;
+    pending.tail = 0;
+    return 1;
+}
+
+/**
+ * Send what an earlier MSG_MORE send left queued on fd. A zero length send
+ * would not do it, turning TCP_NODELAY on pushes pending segments at once;
+ * it goes back off unless the socket options asked for it.
+ */
+void Worker::push_corked(int fd, bool to_client)
+{
+    const Socket_options &opts = to_client ? server->client_socket : server->upstream_socket;
+    int on = 1, off = 0;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    if (opts.nodelay != 1)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &off, sizeof(off));
+}
+
+/**
+ * Move data from src to dst. Reads are gathered into relay_buffer until it
+ * is full, src runs dry or relay_budget is reached, then go out in one
+ * write, with MSG_MORE when the buffer filled and another round follows;
+ * should that round find src dry after all, the corked tail is pushed out.
+ * Whatever dst does not take waits in pending, and src is not read again
+ * before that is flushed. A tapped connection (tap_id) copies what it
+ * reads into the worker's tap ring.
+ * return:
+ *   1   -> drained or dst full, wait for the next event
+ *   2   -> relay_budget used up, data may still be pending
+ *   0   -> peer closed
+ *  -1   -> error
+ */
+int Worker::relay(SSL *src_ssl, int src_fd, SSL *dst_ssl, int dst_fd, Pending_data &pending, uint64_t &bytes, bool to_client, uint64_t tap_id)
+{
+    uint64_t before = bytes;
+    int flushed = flush_pending(dst_ssl, dst_fd, pending, bytes);
+    if (bytes > before)
+        PROXY_PROBE4(relay, src_fd, dst_fd, bytes - before, to_client);
+    if (flushed < 0)
+        return -1;
+    if (flushed == 0)
+        return 1;
+    // src finished earlier, only its tail was still on the way
+    if (pending.eof)
+        return 0;
+
+    // admin may retune it at any time, one value per call
+    size_t relay_budget = server->relay_budget.load(std::memory_order_relaxed);
+
+    // Zerocopy sends read the data after send() returns: use a pool block
+    // that stays with the socket until the kernel reports it done
+    Zerocopy_socket *zc = nullptr;
+    if (!dst_ssl && server->zerocopy_threshold > 0)
+    {
+        auto it = zerocopy_sockets.find(dst_fd);
+        if (it != zerocopy_sockets.end() && !it->second.copied)
+            zc = &it->second;
+    }
+    size_t moved = 0;
+    bool corked = false; // the last send said MSG_MORE
+
+    while (true)
+    {
+        if (relay_budget > 0 && moved >= relay_budget)
+            return 2;
+
+        char *buffer = zc ? buffer_pool.get() : relay_buffer.data();
+        size_t capacity = zc ? buffer_pool.block_size() : relay_buffer.size();
+        // never read past the budget: what is read must be sent now
+        if (relay_budget > 0)
+            capacity = std::min(capacity, relay_budget - moved);
+        size_t len = 0;
+        int state = 1; // 1 drained, 0 eof, -1 error, 2 buffer full or budget used up
+        while (true)
+        {
+            if (len == capacity)
+            {
+                state = 2;
+                break;
+            }
+
+            totals.relay_reads++;
+            int n;
+            if (src_ssl)
+            {
+                n = SSL_read(src_ssl, buffer + len, capacity - len);
+                if (n <= 0)
+                {
+                    int err = SSL_get_error(src_ssl, n);
+                    if (err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE)
+                        state = 1;
+                    else
+                        state = err == SSL_ERROR_ZERO_RETURN ? 0 : -1;
+                    break;
+                }
+            }
+            else
+            {
+                n = recv(src_fd, buffer + len, capacity - len, 0);
+                if (n <= 0)
+                {
+                    if (n == 0)
+                        state = 0;
+                    else
+                        state = errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+                    break;
+                }
+            }
+            len += n;
+        }
+
+        size_t sent = 0;
+        bool write_failed = false;
+        bool pinned = false;
+        if (len == 0 && corked && state == 1)
+            push_corked(dst_fd, to_client);
+        if (len > 0)
+        {
+            // plaintext either way: SSL_read has decrypted it already
+            if (tap_id)
+                tap->data(tap_id, to_client, buffer, len);
+            moved += len;
+            int flags = state == 2 && (relay_budget == 0 || moved < relay_budget) ? MSG_MORE : 0;
+            if (zc && len >= server->zerocopy_threshold)
+                flags |= MSG_ZEROCOPY;
+            while (sent < len)
+            {
+                ssize_t n = write_side(dst_ssl, dst_fd, buffer + sent, len - sent, flags);
+                if (n < 0)
+                    write_failed = true;
+                if (n <= 0)
+                    break;
+                if (flags & MSG_ZEROCOPY)
+                {
+                    zc->next_id++;
+                    pinned = true;
+                    server->metrics.zerocopy_sends++;
+                }
+                sent += n;
+                bytes += n;
+            }
+            if (sent > 0)
+                PROXY_PROBE4(relay, src_fd, dst_fd, sent, to_client);
+            corked = !dst_ssl && (flags & MSG_MORE) && sent > 0;
+            if (sent < len && !write_failed)
+            {
+                // never the zerocopy block itself: it goes back to the pool
+                // on completion while these bytes may still wait
+                pending.block = buffer_pool.get();
+                memcpy(pending.block, buffer + sent, len - sent);
+                pending.head = 0;
+                pending.tail = len - sent;
+                PROXY_PROBE3(backpressure, src_fd, dst_fd, len - sent);
+            }
+        }
+        if (pinned)
+            zc->inflight.emplace_back(zc->next_id - 1, buffer);
+        else if (zc)
+            buffer_pool.put(buffer);
+
+        if (state < 0 || write_failed)
+            return -1;
+        if (state == 0)
+        {
+            if (pending.size() == 0)
+                return 0;
+            // close only after the tail is delivered
+            pending.eof = true;
+            return 1;
+        }
+        if (pending.size() > 0 || state == 1)
+            return 1;
+    }
+}
+
+/**
+ * Turn on SO_ZEROCOPY for a plain socket when zerocopy_threshold is set.
+ * Sockets the kernel refuses simply keep copying.
+ */
+void Worker::enable_zerocopy(int fd)
+{
+    if (server->zerocopy_threshold == 0)
+        return;
+    int one = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    {
+        spdlog::warn("setsockopt SO_ZEROCOPY failed: {}", strerror(errno));
+        return;
+    }
+    zerocopy_sockets[fd] = Zerocopy_socket{0, {}, false, false};
+}
+
+/**
+ * SO_BUSY_POLL / SO_PREFER_BUSY_POLL on a socket of a busy polling worker:
+ * reads poll the device queue instead of waiting for its interrupt. Going
+ * above net.core.busy_read needs CAP_NET_ADMIN; without it the socket
+ * just keeps the default and the loop still spins in user space.
+ */
+void Worker::enable_busy_poll(int fd)
+{
+    if (busy_poll_us == 0)
+        return;
+    int one = 1;
+    if ((setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof(busy_poll_us)) < 0 ||
+         setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one)) < 0) &&
+        !busy_poll_refused_)
+    {
+        spdlog::warn("worker {}: setsockopt SO_BUSY_POLL failed: {}", id, strerror(errno));
+        busy_poll_refused_ = true;
+    }
+}
+
+/**
+ * Write this worker's block of the stats segment; the loop calls it after
+ * every batch. A few stores under the block's seqlock, no syscall: readers
+ * never wait for the worker, nor the worker for them.
+ */
+void Worker::publish_stats(uint64_t now)
+{
+    if (!server->stats)
+        return;
+    Stats_worker *block = server->stats->worker(id);
+    stats_write_begin(&block->seq);
+    block->updated_ns = now;
+    block->cpu = cpu;
+    block->connections = conns.size();
+    block->load = load.load(std::memory_order_relaxed);
+    block->pending_handshakes = handshakes.load(std::memory_order_relaxed);
+    block->queued_handshakes = queued.load(std::memory_order_relaxed);
+    block->ready = ready_conns.size() + ready_tasks.size();
+    block->accepted = totals.accepted;
+    block->closed = totals.closed;
+    block->handshakes = totals.handshakes;
+    block->bytes_in = totals.bytes_in;
+    block->bytes_out = totals.bytes_out;
+    block->batches = totals.batches;
+    block->relay_reads = totals.relay_reads;
+    block->relay_writes = totals.relay_writes;
+    block->pool_blocks = buffer_pool.allocated();
+    stats_write_end(&block->seq);
+}
+
+/**
+ * Read zerocopy completions from the error queue of fd and hand the blocks
+ * they release back to the pool. TCP completes sends in order, so every
+ * range ends at or after the oldest block still pinned.
+ */
+void Worker::reap_zerocopy(int fd)
+{
+    auto it = zerocopy_sockets.find(fd);
+    if (it == zerocopy_sockets.end())
+        return;
+    Zerocopy_socket &zc = it->second;
+
+    while (true)
+    {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0)
+            break;
+
+        for (cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            auto *ee = reinterpret_cast<sock_extended_err *>(CMSG_DATA(cm));
+            if (ee->ee_errno != 0 || ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            if ((ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc.copied)
+            {
+                // pinning pages for a copy costs more than copying up front
+                zc.copied = true;
+                server->metrics.zerocopy_copied++;
+            }
+            while (!zc.inflight.empty() && (int32_t)(zc.inflight.front().first - ee->ee_data) <= 0)
+            {
+                buffer_pool.put(zc.inflight.front().second);
+                zc.inflight.pop_front();
+            }
+        }
+    }
+
+    if (zc.closing && zc.inflight.empty())
+    {
+        close(fd);
+        zerocopy_sockets.erase(it);
+    }
+}
+
+/**
+ * Close a relay socket. One whose zerocopy blocks are still pinned only
+ * sends its FIN now: closing would let the fd number, and the blocks, be
+ * reused while the kernel still transmits from them.
+ */
+void Worker::close_socket(int fd)
+{
+    // the next socket on this fd must not inherit edges or a task
+    if ((size_t)fd < fd_waiters.size())
+        fd_waiters[fd] = Fd_waiter{};
+
+    auto it = zerocopy_sockets.find(fd);
+    if (it != zerocopy_sockets.end())
+    {
+        if (!it->second.inflight.empty())
+        {
+            it->second.closing = true;
+            shutdown(fd, SHUT_WR);
+            return;
+        }
+        zerocopy_sockets.erase(it);
+    }
+    close(fd);
+}
+
+int Worker::handle_client_side(ProxyConnection *conn, Connection_meta &meta)
+{
+    uint64_t before = meta.bytes_in;
+    int ret = relay(conn->ssl, conn->client_fd, conn->upstream_ssl, conn->server_fd, conn->to_server, meta.bytes_in, false, meta.tap_id);
+    totals.bytes_in += meta.bytes_in - before;
+    return ret;
+}
+
+int Worker::handle_server_side(ProxyConnection *conn, Connection_meta &meta)
+{
+    uint64_t before = meta.bytes_out;
+    int ret = relay(conn->upstream_ssl, conn->server_fd, conn->ssl, conn->client_fd, conn->to_client, meta.bytes_out, true, meta.tap_id);
+    totals.bytes_out += meta.bytes_out - before;
+    return ret;
+}